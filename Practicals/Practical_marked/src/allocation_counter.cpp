@@ -0,0 +1,131 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifndef NDEBUG
+namespace {
+
+std::atomic<uint64_t> heap_allocations{0};
+
+// Every form of operator new counts one allocation. The plain forms use
+// malloc and free. The aligned forms over-allocate and keep the malloc
+// pointer just before the aligned block, since aligned_alloc is not
+// available everywhere, so an aligned block is only freed by an aligned
+// delete, as the standard requires anyway.
+void* Allocate(std::size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size ? size : 1);
+}
+
+void* AllocateAligned(std::size_t size, std::align_val_t alignment) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  const std::size_t align = static_cast<std::size_t>(alignment);
+  void* block = std::malloc(size+align+sizeof(void*));
+  if (!block) {
+    return nullptr;
+  }
+  const uintptr_t aligned =
+    (reinterpret_cast<uintptr_t>(block)+sizeof(void*)+align-1)&~(align-1);
+  reinterpret_cast<void**>(aligned)[-1] = block;
+  return reinterpret_cast<void*>(aligned);
+}
+
+void Release(void* data) {
+  std::free(data);
+}
+
+void ReleaseAligned(void* data) {
+  if (data) {
+    std::free(reinterpret_cast<void**>(data)[-1]);
+  }
+}
+
+void* Checked(void* data) {
+  if (!data) {
+    throw std::bad_alloc();
+  }
+  return data;
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  return Checked(Allocate(size));
+}
+void* operator new[](std::size_t size) {
+  return Checked(Allocate(size));
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return Allocate(size);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return Allocate(size);
+}
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return Checked(AllocateAligned(size, alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return Checked(AllocateAligned(size, alignment));
+}
+void* operator new(
+    std::size_t size, std::align_val_t alignment,
+    const std::nothrow_t&) noexcept {
+  return AllocateAligned(size, alignment);
+}
+void* operator new[](
+    std::size_t size, std::align_val_t alignment,
+    const std::nothrow_t&) noexcept {
+  return AllocateAligned(size, alignment);
+}
+
+void operator delete(void* data) noexcept {
+  Release(data);
+}
+void operator delete[](void* data) noexcept {
+  Release(data);
+}
+void operator delete(void* data, std::size_t) noexcept {
+  Release(data);
+}
+void operator delete[](void* data, std::size_t) noexcept {
+  Release(data);
+}
+void operator delete(void* data, const std::nothrow_t&) noexcept {
+  Release(data);
+}
+void operator delete[](void* data, const std::nothrow_t&) noexcept {
+  Release(data);
+}
+void operator delete(void* data, std::align_val_t) noexcept {
+  ReleaseAligned(data);
+}
+void operator delete[](void* data, std::align_val_t) noexcept {
+  ReleaseAligned(data);
+}
+void operator delete(void* data, std::size_t, std::align_val_t) noexcept {
+  ReleaseAligned(data);
+}
+void operator delete[](void* data, std::size_t, std::align_val_t) noexcept {
+  ReleaseAligned(data);
+}
+void operator delete(
+    void* data, std::align_val_t, const std::nothrow_t&) noexcept {
+  ReleaseAligned(data);
+}
+void operator delete[](
+    void* data, std::align_val_t, const std::nothrow_t&) noexcept {
+  ReleaseAligned(data);
+}
+#endif
+
+uint64_t HeapAllocationCount() {
+#ifndef NDEBUG
+  return heap_allocations.load(std::memory_order_relaxed);
+#else
+  return 0;
+#endif
+}
@@ -0,0 +1,14 @@
+#ifndef PRACTICAL_MARKED_ALLOCATION_COUNTER_H_
+#define PRACTICAL_MARKED_ALLOCATION_COUNTER_H_
+
+#include <cstdint>
+
+// allocation_counter.cpp replaces the global operator new and delete of the
+// program that links it, so only the executables list it and the
+// segmentation library keeps the allocator of whoever uses it. The
+// replacement counts in debug builds and is left out of release builds.
+
+// Number of operator new calls so far in debug builds, 0 in release builds.
+uint64_t HeapAllocationCount();
+
+#endif  // PRACTICAL_MARKED_ALLOCATION_COUNTER_H_
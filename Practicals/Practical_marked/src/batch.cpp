@@ -0,0 +1,910 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "allocation_counter.h"
+#include "segmentation.h"
+#include "spsc_queue.h"
+#include "tiled.h"
+
+// Headless front end running the segmentation on many images, e.g.
+//   ISIMA_Practical_Marked_Batch --format json --labels out "data/*.png"
+// Every worker thread owns a Content and segments whole images, which scales
+// better than splitting the rows of a single image in bands. With --pipeline,
+// meant for frame sequences, decoding, segmentation and encoding instead run
+// concurrently as three stages connected by bounded queues. With --tiled,
+// for images larger than memory, the images are segmented one at a time in
+// strips that fit a memory budget, with every thread on each strip.
+
+namespace fs = std::filesystem;
+
+struct BatchOptions {
+  std::vector<std::string> inputs;
+  int32_t thread_count = 0;  // 0 uses every hardware thread
+  bool json = false;
+  std::string output_path;   // Empty writes the report on stdout
+  std::string labels_path;   // Empty skips the labelled PNGs
+  std::string cells_path;    // Empty skips the cell statistics
+  int32_t blur_radius = 1;
+  BorderPolicy border_policy = BorderPolicy::kClamp;
+  MagnitudeMode magnitude_mode = MagnitudeMode::kSquared;
+  uint8_t level_threshold = kLevelThreshold;
+  bool staged = false;       // The 4 stages instead of FusedEdgeMask
+  int32_t seed_count = 1024;
+  uint64_t rng_seed = 0;
+  SeedPlacement seed_placement = SeedPlacement::kUniform;
+  FillMode fill_mode = FillMode::kConnectedComponents;
+  int32_t pyramid_levels = 3;
+  bool verify_pyramid = false;  // Compare the pyramid labels with LabelMask
+  int32_t raw_width = 0;     // Size of the headerless .raw and .rgb files
+  int32_t raw_height = 0;
+  bool pipeline = false;
+  int32_t queue_depth = 4;   // Frames in flight between two stages
+  size_t tiled_budget = 0;   // Bytes of a strip in tiled mode, 0 when off
+  bool profile = false;      // Stage percentiles on stderr
+  bool report_scaling = false;  // ReportStageScaling on the first image
+  int32_t check_allocations = 0;  // Warm runs of CheckAllocations, 0 skips
+  std::string trace_path;    // Empty skips the Chrome trace
+};
+
+struct BatchResult {
+  std::string path;
+  int32_t width = 0;
+  int32_t height = 0;
+  int32_t cell_count = 0;
+  double milliseconds = 0.0;
+  std::string error;         // Empty on success
+};
+
+void PrintUsage() {
+  std::cerr
+    << "Usage: ISIMA_Practical_Marked_Batch [options] <image|dir|glob>...\n"
+    << "  --threads N        worker threads, 0 for every core (default 0)\n"
+    << "  --format csv|json  report format (default csv)\n"
+    << "  --output FILE      write the report to FILE instead of stdout\n"
+    << "  --labels DIR       write <name>_labels.png of every image in DIR\n"
+    << "  --cells DIR        write <name>_cells.csv, the statistics of every\n"
+    << "                     cell, in DIR (labelled fill modes only)\n"
+    << "  --blur-radius N    box blur radius (default 1)\n"
+    << "  --border clamp|mirror|zero  pixels read outside the image (clamp)\n"
+    << "  --magnitude l1|l2|exact  Sobel magnitude (default exact)\n"
+    << "  --threshold N      edge threshold in [0, 255] (default 32)\n"
+    << "  --staged           run grayscale, blur, Sobel and threshold as\n"
+    << "                     separate passes instead of the fused one\n"
+    << "  --fill-mode components|flood|propagation|pyramid\n"
+    << "                     cell labelling (default components)\n"
+    << "  --pyramid-levels N blocks of 2^N pixels in pyramid mode (default 3)\n"
+    << "  --verify-pyramid   fail the images whose pyramid labels differ from\n"
+    << "                     the exact ones\n"
+    << "  --seed-count N     seeds of the flood fill (default 1024)\n"
+    << "  --seed N           RNG seed of the seeds and palettes (default 0)\n"
+    << "  --placement uniform|poisson  seed placement (default uniform)\n"
+    << "  --raw-size WxH     size of the headerless RGB .raw and .rgb files\n"
+    << "  --pipeline         decode, segment and encode in 3 concurrent stages\n"
+    << "  --queue-depth N    frames queued between two stages (default 4)\n"
+    << "  --tiled MIB        segment PPM, PGM or raw files in strips of at\n"
+    << "                     most MIB MiB, writing <name>_labels.ppm\n"
+    << "  --profile          print p50, p95 and p99 of every stage\n"
+    << "  --trace FILE       write the stage timings as a Chrome trace\n"
+    << "  --report-scaling   time every stage of the first image from 1 to\n"
+    << "                     --threads threads before the run\n"
+    << "  --check-allocations N  fail if N runs on the first image allocate\n"
+    << "                     once warmed up (debug builds)\n";
+}
+
+BatchOptions ParseOptions(int argc, char** argv) {
+  BatchOptions options;
+  for (int i=1; i<argc; ++i) {
+    const std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i+1 >= argc) {
+        throw std::runtime_error("[ERROR] Missing value after "+arg);
+      }
+      return argv[++i];
+    };
+    if (arg == "--threads") {
+      options.thread_count = std::stoi(value());
+    } else if (arg == "--format") {
+      const std::string format = value();
+      if (format != "csv" && format != "json") {
+        throw std::runtime_error("[ERROR] Unknown format "+format);
+      }
+      options.json = format == "json";
+    } else if (arg == "--output") {
+      options.output_path = value();
+    } else if (arg == "--labels") {
+      options.labels_path = value();
+    } else if (arg == "--cells") {
+      options.cells_path = value();
+    } else if (arg == "--blur-radius") {
+      options.blur_radius =
+        std::clamp(std::stoi(value()), 0, kMaxBlurRadius);
+    } else if (arg == "--border") {
+      const std::string border = value();
+      if (border == "clamp") {
+        options.border_policy = BorderPolicy::kClamp;
+      } else if (border == "mirror") {
+        options.border_policy = BorderPolicy::kMirror;
+      } else if (border == "zero") {
+        options.border_policy = BorderPolicy::kZero;
+      } else {
+        throw std::runtime_error("[ERROR] Unknown border policy "+border);
+      }
+    } else if (arg == "--magnitude") {
+      const std::string magnitude = value();
+      if (magnitude == "l1") {
+        options.magnitude_mode = MagnitudeMode::kL1;
+      } else if (magnitude == "l2") {
+        options.magnitude_mode = MagnitudeMode::kL2;
+      } else if (magnitude == "exact") {
+        options.magnitude_mode = MagnitudeMode::kSquared;
+      } else {
+        throw std::runtime_error("[ERROR] Unknown magnitude "+magnitude);
+      }
+    } else if (arg == "--threshold") {
+      options.level_threshold =
+        static_cast<uint8_t>(std::clamp(std::stoi(value()), 0, 255));
+    } else if (arg == "--staged") {
+      options.staged = true;
+    } else if (arg == "--fill-mode") {
+      const std::string mode = value();
+      if (mode == "components") {
+        options.fill_mode = FillMode::kConnectedComponents;
+      } else if (mode == "flood") {
+        options.fill_mode = FillMode::kFloodFill;
+      } else if (mode == "propagation") {
+        options.fill_mode = FillMode::kLabelPropagation;
+      } else if (mode == "pyramid") {
+        options.fill_mode = FillMode::kPyramid;
+      } else {
+        throw std::runtime_error("[ERROR] Unknown fill mode "+mode);
+      }
+    } else if (arg == "--pyramid-levels") {
+      options.pyramid_levels = std::clamp(std::stoi(value()), 1, 6);
+    } else if (arg == "--verify-pyramid") {
+      options.verify_pyramid = true;
+    } else if (arg == "--seed-count") {
+      options.seed_count = std::max(0, std::stoi(value()));
+    } else if (arg == "--seed") {
+      options.rng_seed = std::stoull(value());
+    } else if (arg == "--placement") {
+      const std::string placement = value();
+      if (placement == "uniform") {
+        options.seed_placement = SeedPlacement::kUniform;
+      } else if (placement == "poisson") {
+        options.seed_placement = SeedPlacement::kPoissonDisk;
+      } else {
+        throw std::runtime_error("[ERROR] Unknown placement "+placement);
+      }
+    } else if (arg == "--raw-size") {
+      const std::string size = value();
+      const size_t separator = size.find('x');
+      if (separator == std::string::npos) {
+        throw std::runtime_error("[ERROR] Expected WxH, got "+size);
+      }
+      options.raw_width = std::stoi(size.substr(0, separator));
+      options.raw_height = std::stoi(size.substr(separator+1));
+    } else if (arg == "--pipeline") {
+      options.pipeline = true;
+    } else if (arg == "--tiled") {
+      options.tiled_budget = size_t(std::max(1, std::stoi(value())))<<20;
+    } else if (arg == "--queue-depth") {
+      options.queue_depth = std::max(1, std::stoi(value()));
+    } else if (arg == "--profile") {
+      options.profile = true;
+    } else if (arg == "--trace") {
+      options.trace_path = value();
+    } else if (arg == "--report-scaling") {
+      options.report_scaling = true;
+    } else if (arg == "--check-allocations") {
+      options.check_allocations = std::max(1, std::stoi(value()));
+    } else if (arg == "--help" || arg == "-h") {
+      PrintUsage();
+      std::exit(0);
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      throw std::runtime_error("[ERROR] Unknown option "+arg);
+    } else {
+      options.inputs.push_back(arg);
+    }
+  }
+  if (options.inputs.empty()) {
+    PrintUsage();
+    throw std::runtime_error("[ERROR] No input image");
+  }
+  if (!options.cells_path.empty() &&
+      options.fill_mode == FillMode::kFloodFill) {
+    throw std::runtime_error("[ERROR] --cells needs labelled cells");
+  }
+  if (options.verify_pyramid && options.fill_mode != FillMode::kPyramid) {
+    throw std::runtime_error(
+      "[ERROR] --verify-pyramid needs --fill-mode pyramid");
+  }
+  if (options.tiled_budget != 0 &&
+      (options.pipeline || !options.cells_path.empty() ||
+       options.fill_mode != FillMode::kConnectedComponents)) {
+    throw std::runtime_error(
+      "[ERROR] --tiled only labels connected components, without --pipeline "
+      "or --cells");
+  }
+  if (options.tiled_budget != 0 &&
+      (options.report_scaling || options.check_allocations != 0)) {
+    throw std::runtime_error(
+      "[ERROR] --report-scaling and --check-allocations need whole images");
+  }
+#ifdef NDEBUG
+  if (options.check_allocations != 0) {
+    throw std::runtime_error(
+      "[ERROR] --check-allocations needs a debug build to count");
+  }
+#endif
+  return options;
+}
+
+// Matches name against a pattern where '*' is any run of characters and '?'
+// any single character.
+bool MatchWildcard(const std::string& pattern, const std::string& name) {
+  size_t p = 0;
+  size_t n = 0;
+  size_t star = std::string::npos;
+  size_t resume = 0;
+  while (n < name.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+      ++p;
+      ++n;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      star = p++;
+      resume = n;
+    } else if (star != std::string::npos) {
+      p = star+1;
+      n = ++resume;
+    } else {
+      return false;
+    }
+  }
+  while (p < pattern.size() && pattern[p] == '*') {
+    ++p;
+  }
+  return p == pattern.size();
+}
+
+std::string LowerExtension(const fs::path& path) {
+  std::string extension = path.extension().string();
+  std::transform(
+    extension.begin(), extension.end(), extension.begin(),
+    [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  return extension;
+}
+
+bool IsRawImage(const fs::path& path) {
+  const std::string extension = LowerExtension(path);
+  return extension == ".raw" || extension == ".rgb";
+}
+
+bool HasImageExtension(const fs::path& path) {
+  const std::string extension = LowerExtension(path);
+  for (const char* known :
+       {".png", ".jpg", ".jpeg", ".bmp", ".tga", ".gif", ".psd", ".hdr",
+        ".pic", ".ppm", ".pgm", ".pnm", ".raw", ".rgb"}) {
+    if (extension == known) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Expands directories to the images they contain and wildcards in the file
+// name to the matching files. Each group is sorted, so the report order only
+// depends on the command line.
+std::vector<std::string> ExpandInputs(const std::vector<std::string>& inputs) {
+  std::vector<std::string> paths;
+  for (const std::string& input : inputs) {
+    const fs::path path(input);
+    std::vector<std::string> matches;
+    std::error_code error;
+    if (input.find_first_of("*?") != std::string::npos) {
+      const fs::path directory =
+        path.has_parent_path() ? path.parent_path() : fs::path(".");
+      const std::string pattern = path.filename().string();
+      for (const fs::directory_entry& entry :
+           fs::directory_iterator(directory, error)) {
+        if (entry.is_regular_file() &&
+            MatchWildcard(pattern, entry.path().filename().string())) {
+          matches.push_back(entry.path().string());
+        }
+      }
+      if (matches.empty()) {
+        std::cerr << "[WARNING] No file matches " << input << std::endl;
+      }
+    } else if (fs::is_directory(path, error)) {
+      for (const fs::directory_entry& entry :
+           fs::directory_iterator(path, error)) {
+        if (entry.is_regular_file() && HasImageExtension(entry.path())) {
+          matches.push_back(entry.path().string());
+        }
+      }
+    } else {
+      matches.push_back(input);
+    }
+    std::sort(matches.begin(), matches.end());
+    paths.insert(paths.end(), matches.begin(), matches.end());
+  }
+  return paths;
+}
+
+uint32_t Crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+  static const std::vector<uint32_t> table = []() {
+    std::vector<uint32_t> entries(256);
+    for (uint32_t i=0; i<256; ++i) {
+      uint32_t c = i;
+      for (int32_t k=0; k<8; ++k) {
+        c = (c&1u) ? 0xEDB88320u^(c>>1) : c>>1;
+      }
+      entries[i] = c;
+    }
+    return entries;
+  }();
+  crc = ~crc;
+  for (size_t i=0; i<size; ++i) {
+    crc = table[(crc^data[i])&0xFFu]^(crc>>8);
+  }
+  return ~crc;
+}
+
+void AppendBigEndian(std::vector<uint8_t>& out, uint32_t value) {
+  out.push_back(static_cast<uint8_t>(value>>24));
+  out.push_back(static_cast<uint8_t>(value>>16));
+  out.push_back(static_cast<uint8_t>(value>>8));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+void AppendChunk(
+    std::vector<uint8_t>& out, const char* type,
+    const std::vector<uint8_t>& data) {
+  AppendBigEndian(out, static_cast<uint32_t>(data.size()));
+  const size_t start = out.size();
+  out.insert(out.end(), type, type+4);
+  out.insert(out.end(), data.begin(), data.end());
+  AppendBigEndian(out, Crc32(out.data()+start, out.size()-start));
+}
+
+// Writes PackColor pixels as an 8-bit RGB PNG. The label images are flat
+// colors that compress well, but stb only ships a decoder here, so the zlib
+// stream uses stored blocks and the file is about as large as the raw
+// pixels.
+bool WritePng(
+    const std::string& path, const uint32_t* colors,
+    int32_t width, int32_t height) {
+  const size_t row_size = size_t(width)*3+1;  // Filter byte + pixels
+  std::vector<uint8_t> raw(row_size*height);
+  for (int32_t y=0; y<height; ++y) {
+    uint8_t* row = &raw[y*row_size];
+    *row++ = 0;
+    for (int32_t x=0; x<width; ++x) {
+      const uint32_t color = colors[size_t(y)*width+x];
+      *row++ = static_cast<uint8_t>(color);
+      *row++ = static_cast<uint8_t>(color>>8);
+      *row++ = static_cast<uint8_t>(color>>16);
+    }
+  }
+
+  std::vector<uint8_t> zlib = {0x78, 0x01};
+  const size_t kMaxStoredBlock = 65535;
+  for (size_t offset=0; offset<raw.size() || offset == 0;) {
+    const size_t size = std::min(kMaxStoredBlock, raw.size()-offset);
+    const bool last = offset+size == raw.size();
+    zlib.push_back(last ? 1 : 0);
+    zlib.push_back(static_cast<uint8_t>(size));
+    zlib.push_back(static_cast<uint8_t>(size>>8));
+    zlib.push_back(static_cast<uint8_t>(~size));
+    zlib.push_back(static_cast<uint8_t>(~size>>8));
+    zlib.insert(zlib.end(), raw.begin()+offset, raw.begin()+offset+size);
+    offset += size;
+    if (last) {
+      break;
+    }
+  }
+  uint32_t a = 1;
+  uint32_t b = 0;
+  for (size_t i=0; i<raw.size(); ++i) {
+    a = (a+raw[i])%65521u;
+    b = (b+a)%65521u;
+  }
+  AppendBigEndian(zlib, (b<<16)|a);
+
+  std::vector<uint8_t> header;
+  AppendBigEndian(header, static_cast<uint32_t>(width));
+  AppendBigEndian(header, static_cast<uint32_t>(height));
+  header.insert(header.end(), {8, 2, 0, 0, 0});  // 8-bit RGB, no interlace
+
+  std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  AppendChunk(png, "IHDR", header);
+  AppendChunk(png, "IDAT", zlib);
+  AppendChunk(png, "IEND", {});
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(png.data()), png.size());
+  return static_cast<bool>(file);
+}
+
+void WriteLabels(
+    const BatchOptions& options, const std::vector<uint32_t>& colors,
+    BatchResult& result) {
+  if (options.labels_path.empty()) {
+    return;
+  }
+  const fs::path labels_path = fs::path(options.labels_path)/
+    (fs::path(result.path).stem().string()+"_labels.png");
+  if (!WritePng(
+        labels_path.string(), colors.data(), result.width, result.height)) {
+    result.error = "cannot write "+labels_path.string();
+  }
+}
+
+// One line per cell, in label order.
+void WriteCellStats(
+    const BatchOptions& options, const CellStats& stats,
+    BatchResult& result) {
+  if (options.cells_path.empty()) {
+    return;
+  }
+  const fs::path cells_path = fs::path(options.cells_path)/
+    (fs::path(result.path).stem().string()+"_cells.csv");
+  std::ofstream file(cells_path);
+  file << "label,area,min_x,min_y,max_x,max_y,centroid_x,centroid_y,"
+    "mean_r,mean_g,mean_b\n";
+  for (size_t c=0; c<stats.size(); ++c) {
+    file << c+1 << ',' << stats.area[c] << ',' << stats.min_x[c] << ','
+      << stats.min_y[c] << ',' << stats.max_x[c] << ',' << stats.max_y[c]
+      << ',' << stats.centroid_x[c] << ',' << stats.centroid_y[c] << ','
+      << stats.mean_r[c] << ',' << stats.mean_g[c] << ',' << stats.mean_b[c]
+      << '\n';
+  }
+  if (!file) {
+    result.error = "cannot write "+cells_path.string();
+  }
+}
+
+void ConfigureContent(
+    Content& content, const BatchOptions& options, int32_t thread_count,
+    Profiler* profiler) {
+  content.profiler_ = profiler;
+  content.thread_count_ = thread_count;
+  content.thread_pool_.Resize(thread_count);
+  content.blur_radius_ = options.blur_radius;
+  content.border_policy_ = options.border_policy;
+  content.magnitude_mode_ = options.magnitude_mode;
+  content.level_threshold_ = options.level_threshold;
+  content.use_fused_pipeline_ = !options.staged;
+  content.seed_count_ = options.seed_count;
+  content.rng_seed_ = options.rng_seed;
+  content.seed_placement_ = options.seed_placement;
+  content.fill_mode_ = options.fill_mode;
+  content.compute_cell_stats_ = !options.cells_path.empty();
+  content.pyramid_levels_ = options.pyramid_levels;
+  content.verify_pyramid_ = options.verify_pyramid;
+}
+
+// Fails the image when --verify-pyramid found pixels off.
+void CheckPyramidLabels(const Content& content, BatchResult& result) {
+  if (content.pyramid_mismatches_ > 0) {
+    result.error = "pyramid labels differ from the exact ones on "+
+      std::to_string(content.pyramid_mismatches_)+" pixels";
+  }
+}
+
+// Tiled mode: the file has to be mapped, since decoding would need the
+// whole image in memory.
+void ProcessTiled(
+    Content& content, const BatchOptions& options, BatchResult& result) {
+  auto start = std::chrono::steady_clock::now();
+  MappedImage image;
+  const bool mapped = IsRawImage(result.path) ?
+    image.OpenRaw(result.path, options.raw_width, options.raw_height, 3) :
+    image.OpenPnm(result.path);
+  if (!mapped) {
+    result.error = "tiled mode needs a PPM, PGM or raw file";
+    return;
+  }
+  if (image.sample_bytes() != 1) {
+    result.error = "tiled mode needs 8-bit samples";
+    return;
+  }
+  if (TiledStripRows(
+        image.width(), image.height(), image.channels(),
+        options.blur_radius, options.tiled_budget) == 0) {
+    result.error = "--tiled budget below one strip of "+
+      std::to_string(2*options.blur_radius+3)+" rows";
+    return;
+  }
+  std::string labels_path;
+  if (!options.labels_path.empty()) {
+    labels_path = (fs::path(options.labels_path)/
+      (fs::path(result.path).stem().string()+"_labels.ppm")).string();
+  }
+  const bool written =
+    SegmentTiled(content, image, options.tiled_budget, labels_path);
+  auto end = std::chrono::steady_clock::now();
+  result.width = content.width;
+  result.height = content.height;
+  result.cell_count = content.cell_count_;
+  result.milliseconds =
+    std::chrono::duration<double, std::milli>(end-start).count();
+  if (!written) {
+    result.error = "cannot write "+labels_path;
+  }
+}
+
+// Points the image of content at result.path. Returns false, with
+// result.error set, when the file cannot be read.
+bool LoadInput(
+    Content& content, const BatchOptions& options, BatchResult& result) {
+  ScopedTimer timer(content.profiler_, "LoadImage");
+  // PPM, PGM and raw files are mapped instead of decoded.
+  if (IsRawImage(result.path)) {
+    if (!LoadRawImage(
+          content, result.path, options.raw_width, options.raw_height)) {
+      result.error = "raw file does not match --raw-size";
+      return false;
+    }
+  } else if (!LoadImage(content, result.path)) {
+    result.error = "cannot decode image";
+    return false;
+  }
+  return true;
+}
+
+void ProcessImage(
+    Content& content, const BatchOptions& options, BatchResult& result) {
+  auto start = std::chrono::steady_clock::now();
+  if (!LoadInput(content, options, result)) {
+    return;
+  }
+  ComputeSegmentation(content);
+  auto end = std::chrono::steady_clock::now();
+  CheckPyramidLabels(content, result);
+  result.width = content.width;
+  result.height = content.height;
+  result.cell_count = content.cell_count_;
+  result.milliseconds =
+    std::chrono::duration<double, std::milli>(end-start).count();
+  ScopedTimer timer(content.profiler_, "WriteOutputs");
+  WriteLabels(options, content.image_data_color_, result);
+  WriteCellStats(options, content.cell_stats_, result);
+}
+
+// Prints on stderr how every stage of the first image scales from 1 to
+// thread_count threads, the report itself going to stdout.
+void ReportScaling(
+    const BatchOptions& options, int32_t thread_count, BatchResult& result) {
+  Content content;
+  ConfigureContent(content, options, thread_count, nullptr);
+  if (!LoadInput(content, options, result)) {
+    throw std::runtime_error("[ERROR] "+result.path+": "+result.error);
+  }
+  std::cerr << "Stage scaling on " << result.path << " ("
+    << content.width << "x" << content.height << ")" << std::endl;
+  ReportStageScaling(content, std::cerr);
+}
+
+// Segments the first image twice, which grows the frame arena and the
+// buffers to their peak, then check_allocations times more with every stage
+// invalidated, and throws when those runs allocate.
+void CheckAllocations(
+    const BatchOptions& options, int32_t thread_count, BatchResult& result) {
+  Content content;
+  ConfigureContent(content, options, thread_count, nullptr);
+  if (!LoadInput(content, options, result)) {
+    throw std::runtime_error("[ERROR] "+result.path+": "+result.error);
+  }
+  uint64_t allocations = 0;
+  for (int32_t run=0; run<2+options.check_allocations; ++run) {
+    if (run == 2) {
+      allocations = HeapAllocationCount();
+    }
+    InvalidateStages(content);
+    ComputeSegmentation(content);
+  }
+  allocations = HeapAllocationCount()-allocations;
+  std::cerr << "Allocations of " << options.check_allocations
+    << " warm runs on " << result.path << ": " << allocations << std::endl;
+  if (allocations != 0) {
+    throw std::runtime_error("[ERROR] The warm runs allocated");
+  }
+}
+
+// Segments whole images on thread_count workers. Returns the number of
+// threads used.
+int32_t RunWorkers(
+    const BatchOptions& options, int32_t thread_count, Profiler* profiler,
+    std::vector<BatchResult>& results) {
+  thread_count =
+    std::max(1, std::min(thread_count, int32_t(results.size())));
+  // Workers pull the next image until none is left, so a few large images
+  // do not leave the other threads idle.
+  std::atomic<size_t> next_image{0};
+  auto worker = [&]() {
+    Content content;
+    ConfigureContent(content, options, 1, profiler);
+    for (size_t i=next_image++; i<results.size(); i=next_image++) {
+      ProcessImage(content, options, results[i]);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int32_t i=1; i<thread_count; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& thread : workers) {
+    thread.join();
+  }
+  return thread_count;
+}
+
+// Image moving through the pipeline: decoded pixels between the load and
+// process stages, coloured cells between the process and write stages.
+struct Frame {
+  int64_t index = -1;  // Result of the frame, -1 ends the stream
+  bool decoded = false;
+  int32_t width = 0;
+  int32_t height = 0;
+  std::vector<uint8_t> pixels;
+  PixelType pixel_type = PixelType::kU8;
+  std::vector<uint32_t> colors;
+  CellStats cell_stats;
+};
+
+// Decodes on one thread, segments on the calling thread with the band
+// parallel stages, and encodes on a third thread. The bounded queues keep at
+// most queue_depth frames between two stages, so a slow stage stalls the
+// ones before it instead of growing the memory use, and the throughput is
+// the one of the slowest stage. Returns the number of threads used.
+int32_t RunPipeline(
+    const BatchOptions& options, int32_t thread_count, Profiler* profiler,
+    std::vector<BatchResult>& results) {
+  SpscQueue<Frame> decoded(options.queue_depth);
+  SpscQueue<Frame> segmented(options.queue_depth);
+  // Frames handed back by the write stage with their buffers, so the steady
+  // state does not allocate.
+  SpscQueue<Frame> recycled(2*options.queue_depth+2);
+  std::array<double, 3> busy_seconds = {};
+
+  auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(
+      std::chrono::steady_clock::now()-start).count();
+  };
+  std::thread load_stage([&]() {
+    for (size_t i=0; i<results.size(); ++i) {
+      auto start = std::chrono::steady_clock::now();
+      Frame frame;
+      recycled.TryPop(frame);
+      frame.index = static_cast<int64_t>(i);
+      {
+        ScopedTimer timer(profiler, "DecodeImage");
+        if (IsRawImage(results[i].path)) {
+          // Frames own their pixels, so the mapped file is copied once.
+          MappedImage mapped;
+          frame.decoded = mapped.OpenRaw(
+            results[i].path, options.raw_width, options.raw_height, 3) &&
+            FitsWholeImage(mapped.width(), mapped.height(), 3);
+          if (frame.decoded) {
+            frame.pixel_type = PixelType::kU8;
+            frame.width = mapped.width();
+            frame.height = mapped.height();
+            frame.pixels.assign(
+              mapped.pixels(),
+              mapped.pixels()+size_t(frame.width)*frame.height*3);
+          }
+        } else {
+          frame.decoded = DecodeImage(
+            results[i].path, frame.width, frame.height, frame.pixels,
+            frame.pixel_type);
+        }
+      }
+      busy_seconds[0] += seconds_since(start);
+      decoded.Push(std::move(frame));
+    }
+    decoded.Push(Frame());
+  });
+  std::thread write_stage([&]() {
+    for (Frame frame=segmented.Pop(); frame.index >= 0;
+         frame=segmented.Pop()) {
+      auto start = std::chrono::steady_clock::now();
+      ScopedTimer timer(profiler, "WriteOutputs");
+      if (frame.decoded) {
+        WriteLabels(options, frame.colors, results[frame.index]);
+        WriteCellStats(options, frame.cell_stats, results[frame.index]);
+      }
+      recycled.TryPush(frame);
+      busy_seconds[2] += seconds_since(start);
+    }
+  });
+
+  Content content;
+  ConfigureContent(
+    content, options, std::max(1, thread_count-2), profiler);
+  for (Frame frame=decoded.Pop(); frame.index >= 0; frame=decoded.Pop()) {
+    auto start = std::chrono::steady_clock::now();
+    BatchResult& result = results[frame.index];
+    if (frame.decoded) {
+      SetImage(
+        content, frame.width, frame.height, frame.pixels, frame.pixel_type);
+      ComputeSegmentation(content);
+      CheckPyramidLabels(content, result);
+      // The frame leaves with the cell colors and the previous input buffer,
+      // and gives its color buffer to the next frame.
+      frame.colors.swap(content.image_data_color_);
+      std::swap(frame.cell_stats, content.cell_stats_);
+      result.width = content.width;
+      result.height = content.height;
+      result.cell_count = content.cell_count_;
+      result.milliseconds =
+        std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now()-start).count();
+    } else {
+      result.error = "cannot decode image";
+    }
+    busy_seconds[1] += seconds_since(start);
+    segmented.Push(std::move(frame));
+  }
+  segmented.Push(Frame());
+  load_stage.join();
+  write_stage.join();
+
+  std::cerr << "Busy time: load " << busy_seconds[0] << "s, process "
+    << busy_seconds[1] << "s, write " << busy_seconds[2] << "s" << std::endl;
+  return content.thread_pool_.thread_count()+2;
+}
+
+std::string EscapeJson(const std::string& text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      escaped += ' ';
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+std::string EscapeCsv(const std::string& text) {
+  if (text.find_first_of(",\"\n") == std::string::npos) {
+    return text;
+  }
+  std::string escaped = "\"";
+  for (char c : text) {
+    escaped += c;
+    if (c == '"') {
+      escaped += '"';
+    }
+  }
+  return escaped+"\"";
+}
+
+void WriteReport(
+    std::ostream& out, const BatchOptions& options,
+    const std::vector<BatchResult>& results) {
+  if (options.json) {
+    out << "[\n";
+    for (size_t i=0; i<results.size(); ++i) {
+      const BatchResult& result = results[i];
+      out << "  {\"path\": \"" << EscapeJson(result.path) << "\", "
+        << "\"width\": " << result.width << ", "
+        << "\"height\": " << result.height << ", "
+        << "\"cells\": " << result.cell_count << ", "
+        << "\"ms\": " << result.milliseconds << ", "
+        << "\"error\": \"" << EscapeJson(result.error) << "\"}"
+        << (i+1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+  } else {
+    out << "path,width,height,cells,ms,error\n";
+    for (const BatchResult& result : results) {
+      out << EscapeCsv(result.path) << "," << result.width << ","
+        << result.height << "," << result.cell_count << ","
+        << result.milliseconds << "," << EscapeCsv(result.error) << "\n";
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  try {
+    const BatchOptions options = ParseOptions(argc, argv);
+    std::vector<BatchResult> results;
+    for (const std::string& path : ExpandInputs(options.inputs)) {
+      results.emplace_back();
+      results.back().path = path;
+    }
+    if (!options.labels_path.empty()) {
+      fs::create_directories(options.labels_path);
+    }
+    if (!options.cells_path.empty()) {
+      fs::create_directories(options.cells_path);
+    }
+
+    int32_t thread_count = options.thread_count;
+    if (thread_count <= 0) {
+      thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    Profiler stage_profiler;
+    Profiler* profiler =
+      options.profile || !options.trace_path.empty() ?
+      &stage_profiler : nullptr;
+    if (options.report_scaling && !results.empty()) {
+      ReportScaling(options, thread_count, results.front());
+    }
+    if (options.check_allocations != 0 && !results.empty()) {
+      CheckAllocations(options, thread_count, results.front());
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (options.tiled_budget != 0) {
+      Content content;
+      ConfigureContent(content, options, thread_count, profiler);
+      for (BatchResult& result : results) {
+        ProcessTiled(content, options, result);
+      }
+    } else {
+      thread_count = options.pipeline ?
+        RunPipeline(options, thread_count, profiler, results) :
+        RunWorkers(options, thread_count, profiler, results);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    if (options.output_path.empty()) {
+      WriteReport(std::cout, options, results);
+    } else {
+      std::ofstream file(options.output_path);
+      WriteReport(file, options, results);
+      if (!file) {
+        throw std::runtime_error(
+          "[ERROR] Cannot write "+options.output_path);
+      }
+    }
+
+    int32_t failures = 0;
+    for (const BatchResult& result : results) {
+      if (!result.error.empty()) {
+        std::cerr << "[ERROR] " << result.path << ": " << result.error
+          << std::endl;
+        ++failures;
+      }
+    }
+    const double seconds = std::chrono::duration<double>(end-start).count();
+    std::cerr << results.size() << " images in " << seconds << "s with "
+      << thread_count << " threads: " << results.size()/seconds
+      << " images/s" << std::endl;
+
+    if (profiler) {
+      const std::vector<ProfileEvent> events = profiler->Events();
+      if (profiler->dropped() != 0) {
+        std::cerr << "Profile: only the last " << events.size()
+          << " spans were kept" << std::endl;
+      }
+      if (options.profile) {
+        PrintProfile(std::cerr, events);
+      }
+      if (!options.trace_path.empty() &&
+          !WriteChromeTrace(options.trace_path, events)) {
+        throw std::runtime_error(
+          "[ERROR] Cannot write "+options.trace_path);
+      }
+    }
+    return failures == 0 ? 0 : 1;
+  } catch (const std::exception& error) {
+    std::cerr << error.what() << std::endl;
+    return 1;
+  }
+}
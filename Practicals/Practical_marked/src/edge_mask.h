@@ -0,0 +1,63 @@
+#ifndef PRACTICAL_MARKED_EDGE_MASK_H_
+#define PRACTICAL_MARKED_EDGE_MASK_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "simd.h"
+
+// Binary output of the threshold stage with one bit per pixel, set on the
+// edges. Every row starts on a new 64-bit word and the padding bits after the
+// last pixel are set, so whole words of edges can be skipped at once.
+struct EdgeMask {
+  int32_t width = 0;
+  int32_t height = 0;
+  int32_t words_per_row = 0;
+  std::vector<uint64_t> words;
+
+  void Resize(int32_t mask_width, int32_t mask_height) {
+    width = mask_width;
+    height = mask_height;
+    words_per_row = (width+63)/64;
+    words.resize(words_per_row*height);
+  }
+
+  uint64_t* Row(int32_t y) {
+    return words.data()+y*words_per_row;
+  }
+
+  const uint64_t* Row(int32_t y) const {
+    return words.data()+y*words_per_row;
+  }
+
+  bool IsEdge(int32_t x, int32_t y) const {
+    return (Row(y)[x>>6]>>(x&63))&1u;
+  }
+
+  // First x' >= x of row y that is not an edge, or width.
+  int32_t NextNonEdge(int32_t x, int32_t y) const {
+    const uint64_t* row = Row(y);
+    int32_t word = x>>6;
+    uint64_t free_bits = ~row[word]&(~uint64_t(0)<<(x&63));
+    while (free_bits == 0) {
+      if (++word == words_per_row) {
+        return width;
+      }
+      free_bits = ~row[word];
+    }
+    return std::min(word*64+CountTrailingZeros(free_bits), width);
+  }
+
+  static int32_t CountTrailingZeros(uint64_t bits) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return static_cast<int32_t>(index);
+#else
+    return __builtin_ctzll(bits);
+#endif
+  }
+};
+
+#endif  // PRACTICAL_MARKED_EDGE_MASK_H_
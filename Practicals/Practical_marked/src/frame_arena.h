@@ -0,0 +1,77 @@
+#ifndef PRACTICAL_MARKED_FRAME_ARENA_H_
+#define PRACTICAL_MARKED_FRAME_ARENA_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for the scratch memory of one frame. Allocate only moves
+// an offset, and Reset releases everything at once at the start of the next
+// frame. When a frame needs more than the block holds, the rest comes from
+// overflow chunks, and the next Reset grows the block to the peak use. The
+// frames after that do not touch the heap as long as the image keeps its
+// size.
+class FrameArena {
+ public:
+  static constexpr size_t kAlignment = 64;  // Cache line
+
+  FrameArena() = default;
+  FrameArena(const FrameArena&) = delete;
+  FrameArena& operator=(const FrameArena&) = delete;
+
+  // Uninitialized storage for count values, valid until the next Reset.
+  template <typename T>
+  T* Allocate(size_t count) {
+    static_assert(
+      std::is_trivially_copyable<T>::value &&
+      std::is_trivially_destructible<T>::value,
+      "FrameArena never runs constructors or destructors");
+    return static_cast<T*>(AllocateBytes(count*sizeof(T)));
+  }
+
+  void Reset() {
+    const size_t used = used_+overflow_bytes_;
+    peak_ = std::max(peak_, used);
+    overflow_.clear();
+    overflow_bytes_ = 0;
+    used_ = 0;
+    if (peak_ > capacity_) {
+      capacity_ = peak_;
+      block_.reset(new uint8_t[capacity_+kAlignment]);
+    }
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+ private:
+  static uint8_t* Align(uint8_t* data) {
+    const uintptr_t address = reinterpret_cast<uintptr_t>(data);
+    return data+((kAlignment-address%kAlignment)%kAlignment);
+  }
+
+  void* AllocateBytes(size_t size) {
+    size = (size+kAlignment-1)/kAlignment*kAlignment;
+    if (used_+size <= capacity_) {
+      uint8_t* data = Align(block_.get())+used_;
+      used_ += size;
+      return data;
+    }
+    overflow_.emplace_back(new uint8_t[size+kAlignment]);
+    overflow_bytes_ += size;
+    return Align(overflow_.back().get());
+  }
+
+  std::unique_ptr<uint8_t[]> block_;
+  size_t capacity_ = 0;
+  size_t used_ = 0;
+  size_t peak_ = 0;
+  std::vector<std::unique_ptr<uint8_t[]>> overflow_;
+  size_t overflow_bytes_ = 0;
+};
+
+#endif  // PRACTICAL_MARKED_FRAME_ARENA_H_
@@ -4,12 +4,10 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <vector>
-#include <random>
-#include <stack>
 #include <string>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb_image.h>
+#include "allocation_counter.h"
+#include "segmentation.h"
 
 const char *kVertexSource = R"(
 #version 430 core
@@ -41,50 +39,91 @@ void main() {
   output_color = vec4(color, 1.0);
 })";
 
-struct Content {
-  int32_t width = 1024;
-  int32_t height = 1024;
-  std::vector<uint8_t> image_original_;
-  std::vector<uint8_t> image_data_color_;
-  std::vector<uint8_t> image_data_grayscale_;
-  std::vector<std::pair<int32_t, int32_t>> seeds_;
-  int32_t cell_count_ = 0;
+// Pixel unpack buffers the texture uploads cycle through. The GPU reads one
+// while the CPU fills the next, and a buffer is only written again once the
+// fence of its last upload has passed.
+const int32_t kUploadBufferCount = 3;
+const GLuint64 kFenceTimeout = 1000000000;  // 1 s in nanoseconds
 
+// OpenGL side of the practical, drawing image_data_color_ of a Content.
+struct Viewer {
   GLuint kernel_draw_image_ = 0;
-  GLuint texture_ = 0;
+  GLuint texture_ = 0;                 // Immutable, texture_width_*height_
+  int32_t texture_width_ = 0;
+  int32_t texture_height_ = 0;
+  GLuint upload_buffers_[kUploadBufferCount] = {};
+  uint32_t* upload_pixels_[kUploadBufferCount] = {};  // Persistent mappings
+  GLsync upload_fences_[kUploadBufferCount] = {};     // Last upload of each
+  int32_t next_upload_ = 0;
+  StageCache texture_stage_;
+  std::string trace_path_;  // --trace, empty skips the Chrome trace
 };
 
-void Initialization(Content& content) {
-  int32_t planes;
-  std::string image_path = std::string(RESOURCES_PATH)+"/input_data.png";
-  uint8_t* image_data_raw =
-    stbi_load(image_path.c_str(), &content.width, &content.width, &planes, 3);
-  content.image_original_.resize(content.width*content.height*3);
-  memcpy(
-    content.image_original_.data(),
-    image_data_raw,
-    content.image_original_.size());
-  delete image_data_raw;
-
-  content.image_data_color_ = content.image_original_;
-
-  glGenTextures(1, &content.texture_);
-  glBindTexture(GL_TEXTURE_2D, content.texture_);
+void DestroyTexture(Viewer& viewer) {
+  for (int32_t i=0; i<kUploadBufferCount; ++i) {
+    if (viewer.upload_fences_[i]) {
+      glDeleteSync(viewer.upload_fences_[i]);
+      viewer.upload_fences_[i] = nullptr;
+    }
+    viewer.upload_pixels_[i] = nullptr;
+  }
+  // Deleting a buffer also unmaps it.
+  glDeleteBuffers(kUploadBufferCount, viewer.upload_buffers_);
+  std::fill(
+    viewer.upload_buffers_, viewer.upload_buffers_+kUploadBufferCount, 0u);
+  glDeleteTextures(1, &viewer.texture_);
+  viewer.texture_ = 0;
+  viewer.texture_width_ = 0;
+  viewer.texture_height_ = 0;
+  viewer.next_upload_ = 0;
+}
+
+// Gives the texture the size of the image. The storage of the texture and
+// of the upload buffers is immutable, so the driver never reallocates it
+// behind an upload, and only a new image size recreates them. The buffers
+// stay mapped for their whole life, coherently, so the CPU writes reach
+// the GPU without any map, unmap or flush call.
+void ResizeTexture(Viewer& viewer, int32_t width, int32_t height) {
+  if (viewer.texture_ != 0 && viewer.texture_width_ == width &&
+      viewer.texture_height_ == height) {
+    return;
+  }
+  DestroyTexture(viewer);
+  glGenTextures(1, &viewer.texture_);
+  glBindTexture(GL_TEXTURE_2D, viewer.texture_);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexImage2D(
-    GL_TEXTURE_2D,
-    0,
-    GL_RGB8,
-    content.width,
-    content.height,
-    0,
-    GL_RGB,
-    GL_UNSIGNED_BYTE,
-    nullptr);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
   glBindTexture(GL_TEXTURE_2D, 0);
+  viewer.texture_width_ = width;
+  viewer.texture_height_ = height;
+
+  const GLsizeiptr size = GLsizeiptr(width)*height*sizeof(uint32_t);
+  const GLbitfield flags =
+    GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+  glGenBuffers(kUploadBufferCount, viewer.upload_buffers_);
+  for (int32_t i=0; i<kUploadBufferCount; ++i) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, viewer.upload_buffers_[i]);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+    viewer.upload_pixels_[i] = static_cast<uint32_t*>(
+      glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags));
+    if (!viewer.upload_pixels_[i]) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      throw std::runtime_error("[ERROR] Map upload buffer");
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void Initialization(Content& content, Viewer& viewer) {
+  std::string image_path = std::string(RESOURCES_PATH)+"/input_data.png";
+  if (!LoadImage(content, image_path)) {
+    throw std::runtime_error("[ERROR] Load "+image_path);
+  }
+  content.thread_pool_.Resize(content.thread_count_);
+  ResizeTexture(viewer, content.width, content.height);
 
   GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
   glShaderSource(vertex_shader, 1, &kVertexSource, nullptr);
@@ -120,288 +159,182 @@ void Initialization(Content& content) {
     }
   }
 
-  content.kernel_draw_image_ = glCreateProgram();
-  glAttachShader(content.kernel_draw_image_, vertex_shader);
-  glAttachShader(content.kernel_draw_image_, fragment_shader);
-  glLinkProgram(content.kernel_draw_image_);
+  viewer.kernel_draw_image_ = glCreateProgram();
+  glAttachShader(viewer.kernel_draw_image_, vertex_shader);
+  glAttachShader(viewer.kernel_draw_image_, fragment_shader);
+  glLinkProgram(viewer.kernel_draw_image_);
   ok = GL_FALSE;
-  glGetProgramiv(content.kernel_draw_image_, GL_LINK_STATUS, &ok);
+  glGetProgramiv(viewer.kernel_draw_image_, GL_LINK_STATUS, &ok);
   if (!ok) {
     GLint length;
     glGetProgramiv(
-      content.kernel_draw_image_, GL_INFO_LOG_LENGTH, &length);
+      viewer.kernel_draw_image_, GL_INFO_LOG_LENGTH, &length);
     if (length > 0) {
       std::vector<GLchar> log(length+1, 0);
       glGetProgramInfoLog(
-        content.kernel_draw_image_, length, nullptr, log.data());
+        viewer.kernel_draw_image_, length, nullptr, log.data());
       throw std::runtime_error(
         std::string("[ERROR] Program draw link fail")+
         std::string(log.data()));
     }
   }
-  glDetachShader(content.kernel_draw_image_, vertex_shader);
-  glDetachShader(content.kernel_draw_image_, fragment_shader);
+  glDetachShader(viewer.kernel_draw_image_, vertex_shader);
+  glDetachShader(viewer.kernel_draw_image_, fragment_shader);
   glDeleteShader(vertex_shader);
   glDeleteShader(fragment_shader);
 }
 
-void GrayscaleConversion(Content& content) {
-  content.image_data_grayscale_.resize(content.width*content.height);
-  for (int32_t x=0; x<content.width; ++x) {
-    for (int32_t y=0; y<content.height; ++y) {
-      uint32_t sum = 0;
-      sum += content.image_data_color_[y*content.width*3+x*3+0];
-      sum += content.image_data_color_[y*content.width*3+x*3+1];
-      sum += content.image_data_color_[y*content.width*3+x*3+2];
-      content.image_data_grayscale_[y*content.width+x] = sum/3;
+// Streams image_data_color_ through the next upload buffer. The copy into
+// the mapped memory is the only CPU work, split in bands, and the texture is
+// then updated from the buffer, so glTexSubImage2D returns at once and the
+// GPU copies the pixels while the CPU goes on with the next frame. The
+// fence placed after it tells when the buffer can be written again, which
+// with 3 buffers is almost always already the case.
+void SendTextureToGPU(Content& content, Viewer& viewer) {
+  ScopedTimer timer(content.profiler_, "SendTextureToGPU");
+  const int32_t width = content.width;
+  ResizeTexture(viewer, width, content.height);
+  const int32_t upload = viewer.next_upload_;
+  viewer.next_upload_ = (upload+1)%kUploadBufferCount;
+  GLsync& fence = viewer.upload_fences_[upload];
+  if (fence) {
+    GLenum status;
+    do {
+      status = glClientWaitSync(
+        fence, GL_SYNC_FLUSH_COMMANDS_BIT, kFenceTimeout);
+    } while (status == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(fence);
+    fence = nullptr;
+    if (status == GL_WAIT_FAILED) {
+      throw std::runtime_error("[ERROR] Wait upload fence");
     }
   }
-}
 
-void BlurImage(Content& content) {
-  std::vector<uint8_t> image_blurred(content.width*content.height, 0u);
-  std::vector<uint8_t>& image_grayscale = content.image_data_grayscale_;
-  for (int32_t x=1; x<content.width-1; ++x) {
-    for (int32_t y=1; y<content.height-1; ++y) {
-      int32_t sum = 0;
-      sum += image_grayscale[(y-1)*content.width+(x-1)];
-      sum += image_grayscale[(y-1)*content.width+(x+0)];
-      sum += image_grayscale[(y-1)*content.width+(x+1)];
-      sum += image_grayscale[(y+0)*content.width+(x-1)];
-      sum += image_grayscale[(y+0)*content.width+(x+0)];
-      sum += image_grayscale[(y+0)*content.width+(x+1)];
-      sum += image_grayscale[(y+1)*content.width+(x-1)];
-      sum += image_grayscale[(y+1)*content.width+(x+0)];
-      sum += image_grayscale[(y+1)*content.width+(x+1)];
-      image_blurred[y*content.width+x] = static_cast<uint8_t>(sum/9);
-    }
-  }
-  content.image_data_grayscale_ = image_blurred;
-}
-
-void ContourDetection(Content& content) {
-  const float Sobel_x[3][3] = {
-    {-1, 0, 1},
-    {-2, 0, 2},
-    {-1, 0, 1}
-  };
-  const float Sobel_y[3][3] = {
-    {-1, -2, -1},
-    {0, 0, 0},
-    {1, 2, 1}
-  };
-
-  std::vector<uint8_t> contour(content.width*content.height, 0u);
-  std::vector<uint8_t>& image_grayscale = content.image_data_grayscale_;
-  int32_t max_value = -1000;
-  int32_t min_value = 1000;
-  for (int32_t x=1; x<content.width-1; ++x) {
-    for (int32_t y=1; y<content.height-1; ++y) {
-      int32_t Gx =
-        image_grayscale[(y-1)*content.width+(x-1)]+
-        2*image_grayscale[(y)*content.width+(x-1)]+
-        image_grayscale[(y+1)*content.width+(x-1)]-
-        image_grayscale[(y-1)*content.width+(x+1)]-
-        2*image_grayscale[(y)*content.width+(x+1)]-
-        image_grayscale[(y+1)*content.width+(x+1)];
-
-      int32_t Gy =
-        image_grayscale[(y-1)*content.width+(x-1)]+
-        2*image_grayscale[(y-1)*content.width+(x)]+
-        image_grayscale[(y-1)*content.width+(x+1)]-
-        image_grayscale[(y+1)*content.width+(x-1)]-
-        2*image_grayscale[(y+1)*content.width+(x)]-
-        image_grayscale[(y+1)*content.width+(x+1)];
-      
-      int32_t value = static_cast<uint8_t>(std::sqrt(Gx*Gx+Gy*Gy));
-
-      contour[y*content.width+x] = value;
-    }
-  }
-
-  content.image_data_grayscale_ = contour;
-  for (int32_t x=0; x<content.width; ++x) {
-    content.image_data_grayscale_[x] =
-      content.image_data_grayscale_[content.width+x];
-    content.image_data_grayscale_[(content.height-1)*content.width+x] =
-      content.image_data_grayscale_[(content.height-2)*content.width+x];
-  }
-  for (int32_t y=0; y<content.height; ++y) {
-    content.image_data_grayscale_[y*content.width] =
-      content.image_data_grayscale_[y*content.width+1];
-    content.image_data_grayscale_[y*content.width+content.width-1] =
-      content.image_data_grayscale_[y*content.width+content.width-2];
-  }
-}
-
-void ApplyLevel(Content& content) {
-  std::vector<uint8_t>& image_grayscale = content.image_data_grayscale_;
-  for (int32_t x=0; x<content.width; ++x) {
-    for (int32_t y=0; y<content.height; ++y) {
-      uint8_t& pixel_color = image_grayscale[(y)*content.width+(x)];
-      if (pixel_color < 32) {
-        pixel_color = 0u;
-      } else {
-        pixel_color = 255u;
-      }
-    }
-  }
-}
-
-void ClearImage(Content& content) {
-  std::fill(
-    content.image_data_color_.begin(), content.image_data_color_.end(), 0);
-}
-
-void AddSeeds(Content& content) {
-  content.seeds_.clear();
-  content.seeds_.resize(1024);
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<float> d(0, 1);
-  for (int32_t i = 0; i<content.seeds_.size(); ++i) {
-    int32_t x = d(gen)*content.width;
-    int32_t y = d(gen)*content.height;
-    if (content.image_data_grayscale_[(y)*content.width+(x)] == 0) {
-      content.seeds_[i] = std::make_pair(x, y);
-      content.image_data_color_[y*content.width*3+x*3+0] = (d(gen)*0.9f+0.1f)*255;
-      content.image_data_color_[y*content.width*3+x*3+1] = (d(gen)*0.9f+0.1f)*255;
-      content.image_data_color_[y*content.width*3+x*3+2] = (d(gen)*0.9f+0.1f)*255;
-    }
-  }
+  // The stages do not write their colors straight into the mapping. The
+  // mapped memory is usually write-combined, so FloodFill and
+  // ComputeHistogram reading image_data_color_ back from it would crawl,
+  // and the cached colors would have to follow the buffer the ring hands
+  // out. One streaming copy per changed frame costs less than either.
+  const uint32_t* colors = content.image_data_color_.data();
+  uint32_t* pixels = viewer.upload_pixels_[upload];
+  content.thread_pool_.ParallelBands(
+    content.height, [&](int32_t, int32_t begin, int32_t end) {
+      std::copy(colors+size_t(begin)*width, colors+size_t(end)*width,
+        pixels+size_t(begin)*width);
+    });
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, viewer.upload_buffers_[upload]);
+  glBindTexture(GL_TEXTURE_2D, viewer.texture_);
+  glTexSubImage2D(
+    GL_TEXTURE_2D,
+    0,
+    0,
+    0,
+    width,
+    content.height,
+    GL_RGBA,
+    GL_UNSIGNED_BYTE,
+    nullptr);  // Offset in the bound buffer
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 }
 
-void FloodFill(Content& content) {
-  for (std::pair<int32_t, int32_t>& seed : content.seeds_) {
-    std::stack<std::pair<int32_t, int32_t>> neighborhood;
-    uint8_t r = 0;
-    uint8_t g = 0;
-    uint8_t b = 0;
-    {
-      const int32_t x = seed.first;
-      const int32_t y = seed.second;
-      r = content.image_data_color_[y*content.width*3+x*3+0];
-      g = content.image_data_color_[y*content.width*3+x*3+1];
-      b = content.image_data_color_[y*content.width*3+x*3+2];
-      neighborhood.push(std::make_pair(x-1, y));
-      neighborhood.push(std::make_pair(x+1, y));
-      neighborhood.push(std::make_pair(x, y-1));
-      neighborhood.push(std::make_pair(x, y+1));
+// --self-test: streams kUploadBufferCount+1 frames, each with a new palette,
+// through the upload buffers, so the ring wraps around and waits on a fence,
+// and reads every frame back from the texture. Returns false when a texel
+// differs from image_data_color_. The window stays hidden, so it also runs
+// on Mesa llvmpipe, e.g. under LIBGL_ALWAYS_SOFTWARE=1 xvfb-run when the
+// machine has no display.
+bool UploadSelfTest(Content& content, Viewer& viewer) {
+  std::vector<uint32_t> texels;
+  for (int32_t frame=0; frame<=kUploadBufferCount; ++frame) {
+    content.rng_seed_ = frame;
+    ComputeSegmentation(content);
+    SendTextureToGPU(content, viewer);
+    texels.resize(content.image_data_color_.size());
+    glBindTexture(GL_TEXTURE_2D, viewer.texture_);
+    glGetTexImage(
+      GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    size_t mismatches = 0;
+    for (size_t i=0; i<texels.size(); ++i) {
+      mismatches += texels[i] != content.image_data_color_[i];
     }
-
-    while (!neighborhood.empty()) {
-      const int32_t x = neighborhood.top().first;
-      const int32_t y = neighborhood.top().second;
-      neighborhood.pop();
-      if (x < 0 || x >= content.width || y < 0 || y >= content.height) {
-        continue;
-      }
-      if (content.image_data_grayscale_[(y)*content.width+(x)] > 0) {
-        continue;
-      }
-      uint8_t image_color[3] = {
-        content.image_data_color_[y*content.width*3+x*3+0],
-        content.image_data_color_[y*content.width*3+x*3+1],
-        content.image_data_color_[y*content.width*3+x*3+2]
-      };
-      if (image_color[0] == r && image_color[1] == g && image_color[2] == b) {
-        continue;
-      }
-      if ((image_color[0] != 0 || image_color[1] != 0 || image_color[2] != 0)&&
-          !(image_color[0] == r && image_color[1] == g && image_color[2] == b)) {
-        content.seeds_.erase(
-          std::remove(
-            content.seeds_.begin(), content.seeds_.end(), std::make_pair(x, y)),
-          content.seeds_.end());
-      }
-      content.image_data_color_[y*content.width*3+x*3+0] = r;
-      content.image_data_color_[y*content.width*3+x*3+1] = g;
-      content.image_data_color_[y*content.width*3+x*3+2] = b;
-      neighborhood.push(std::make_pair(x-1, y));
-      neighborhood.push(std::make_pair(x+1, y));
-      neighborhood.push(std::make_pair(x, y-1));
-      neighborhood.push(std::make_pair(x, y+1));
+    const GLenum error = glGetError();
+    std::cout << "Upload " << frame << ": " << mismatches
+      << " texels off, OpenGL error " << error << std::endl;
+    if (mismatches != 0 || error != GL_NO_ERROR) {
+      return false;
     }
   }
+  return true;
 }
 
-void ComputeHistogram(Content& content) {
-  std::vector<uint8_t> red(255, 0);
-  std::vector<uint8_t> green(255, 0);
-  std::vector<uint8_t> blue(255, 0);
-  for (int32_t x=0; x<content.width; ++x) {
-    for (int32_t y=0; y<content.height; ++y) {
-      ++red[content.image_data_color_[y*content.width*3+x*3+0]];
-      ++green[content.image_data_color_[y*content.width*3+x*3+1]];
-      ++blue[content.image_data_color_[y*content.width*3+x*3+2]];
-    }
-  }
-
-  content.cell_count_ = 0;
-  for (uint8_t r : red) {
-    if (r > 0) {
-      ++content.cell_count_;
-    }
+// Recomputes the stages that are out of date and draws the result. Returns
+// false when neither the cells nor the texture changed.
+bool ComputeFrame(Content& content, Viewer& viewer) {
+  ScopedTimer timer(content.profiler_, "ComputeFrame");
+  ComputeSegmentation(content);
+  const bool changed =
+    viewer.texture_stage_.Update({content.cells_stage_.version});
+  if (changed) {
+    SendTextureToGPU(content, viewer);
   }
-}
-
-void SendTextureToGPU(Content& content) {
-  glBindTexture(GL_TEXTURE_2D, content.texture_);
-  glTexImage2D(
-    GL_TEXTURE_2D,
-    0,
-    GL_RGB8,
-    content.width,
-    content.height,
-    0,
-    GL_RGB,
-    GL_UNSIGNED_BYTE,
-    content.image_data_color_.data());
-  glBindTexture(GL_TEXTURE_2D, 0);
-}
-
-void ComputeFrame(Content& content) {
-  content.image_data_color_ = content.image_original_;
-  GrayscaleConversion(content);
-  ClearImage(content);
-  BlurImage(content);
-  ContourDetection(content);
-  ApplyLevel(content);
-  AddSeeds(content);
-  FloodFill(content);
-  ComputeHistogram(content);
-  SendTextureToGPU(content);
 
   glClearColor(0.16, 0.16, 0.16, 0.0);
   glClear(GL_COLOR_BUFFER_BIT);
 
-  glUseProgram(content.kernel_draw_image_);
-  if (content.texture_ != 0) {
-    glBindTexture(GL_TEXTURE_2D, content.texture_);
+  glUseProgram(viewer.kernel_draw_image_);
+  if (viewer.texture_ != 0) {
+    glBindTexture(GL_TEXTURE_2D, viewer.texture_);
     glUniform1i(
       glGetUniformLocation(
-        content.kernel_draw_image_, "has_texture_"), 1);
+        viewer.kernel_draw_image_, "has_texture_"), 1);
     glUniform1i(
-      glGetUniformLocation(content.kernel_draw_image_, "texture_"), 0);
+      glGetUniformLocation(viewer.kernel_draw_image_, "texture_"), 0);
   }
   glDrawArrays(GL_TRIANGLES, 0, 6);
   glBindTexture(GL_TEXTURE_2D, 0);
   glUseProgram(0);
+  return changed;
 }
 
-void Destroy(Content& content) {
-  glDeleteProgram(content.kernel_draw_image_);
+void Destroy(Viewer& viewer) {
+  DestroyTexture(viewer);
+  glDeleteProgram(viewer.kernel_draw_image_);
 }
 
-void main() {
+// Usage: ISIMA_Practical_Marked [--report-scaling] [--trace FILE]
+//                               [--self-test]
+int main(int argc, char** argv) {
+  Content content;
+  Viewer viewer;
+  bool self_test = false;
+  for (int i=1; i<argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--report-scaling") {
+      content.report_stage_scaling_ = true;
+    } else if (arg == "--self-test") {
+      self_test = true;
+    } else if (arg == "--trace" && i+1 < argc) {
+      viewer.trace_path_ = argv[++i];
+    } else {
+      std::cerr << "[ERROR] Unknown option or missing value " << arg
+        << std::endl;
+      return 1;
+    }
+  }
+
   if (!glfwInit()) {
     throw std::runtime_error("[ERROR] init GLFW");
   }
 
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);  // glBufferStorage
   glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_VISIBLE, self_test ? GLFW_FALSE : GLFW_TRUE);
 
   GLFWwindow* window =
     glfwCreateWindow(800, 800, "ISIMA_Practical_Marked", nullptr, nullptr);
@@ -424,11 +357,22 @@ void main() {
 
   std::cout<<"OpenGL version "<<glGetString(GL_VERSION)<<std::endl;
   std::cout<<"Device: "<<glGetString(GL_RENDERER)<<std::endl;
+  std::cout<<"SIMD: "<<SimdLevelName(DetectSimdLevel())<<std::endl;
 
   bool running = true;
-  Content content;
+  Profiler profiler;
+  content.profiler_ = &profiler;
 
-  Initialization(content);
+  Initialization(content, viewer);
+  if (content.report_stage_scaling_) {
+    ReportStageScaling(content, std::cout);
+  }
+  if (self_test) {
+    const bool passed = UploadSelfTest(content, viewer);
+    Destroy(viewer);
+    glfwTerminate();
+    return passed ? 0 : 1;
+  }
 
   GLuint VAO = 0;
   glGenVertexArrays(1, &VAO);
@@ -439,13 +383,30 @@ void main() {
     }
 
     auto start = std::chrono::steady_clock::now(); // From https://en.cppreference.com/w/cpp/chrono
+    const uint64_t allocations = HeapAllocationCount();
     glBindVertexArray(VAO);
-    ComputeFrame(content);
+    const bool changed = ComputeFrame(content, viewer);
     glBindVertexArray(0);
-    std::cout << "Cell count: " << content.cell_count_ << std::endl;
-    auto end = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end-start;
-    std::cout << "elapsed time: " << elapsed_seconds.count() << "s" << std::endl << std::endl;
+#ifndef NDEBUG
+    // A frame that recomputes nothing has no reason to allocate.
+    if (!changed && HeapAllocationCount() != allocations) {
+      throw std::runtime_error("[ERROR] Unchanged frame allocated");
+    }
+#endif
+    if (changed) {
+      std::cout << "Cell count: " << content.cell_count_ << std::endl;
+      if (content.fill_mode_ == FillMode::kFloodFill) {
+        std::cout << "Surviving seeds: " << content.seeds_.size() << std::endl;
+      }
+#ifndef NDEBUG
+      // Only the first frames and the frames after a resize should allocate.
+      std::cout << "Heap allocations: "
+        << HeapAllocationCount()-allocations << std::endl;
+#endif
+      auto end = std::chrono::steady_clock::now();
+      std::chrono::duration<double> elapsed_seconds = end-start;
+      std::cout << "elapsed time: " << elapsed_seconds.count() << "s" << std::endl << std::endl;
+    }
 
     GLuint OpenGL_error = glGetError();
     if (OpenGL_error) {
@@ -454,10 +415,25 @@ void main() {
     }
 
     glfwSwapBuffers(window);
-    glfwPollEvents();
+    // Nothing changes until an event arrives, so an idle window sleeps.
+    if (changed) {
+      glfwPollEvents();
+    } else {
+      glfwWaitEvents();
+    }
   }
 
-  Destroy(content);
+  Destroy(viewer);
+
+  // The stages that ran, slowest spans included, for the whole session.
+  const std::vector<ProfileEvent> events = profiler.Events();
+  PrintProfile(std::cout, events);
+  const bool trace_written = viewer.trace_path_.empty() ||
+    WriteChromeTrace(viewer.trace_path_, events);
+  if (!trace_written) {
+    std::cerr << "[ERROR] Write " << viewer.trace_path_ << std::endl;
+  }
 
   glfwTerminate();
+  return trace_written ? 0 : 1;
 }
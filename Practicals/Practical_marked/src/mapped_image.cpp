@@ -0,0 +1,168 @@
+#include "mapped_image.h"
+
+#include <cctype>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool MappedImage::Map(const std::string& path) {
+  Close();
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(
+    path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+    FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+  HANDLE mapping =
+    CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapping) {
+    CloseHandle(file);
+    return false;
+  }
+  void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!data) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+  file_ = file;
+  mapping_ = mapping;
+  size_ = static_cast<size_t>(size.QuadPart);
+#else
+  const int file = open(path.c_str(), O_RDONLY);
+  if (file < 0) {
+    return false;
+  }
+  struct stat status;
+  if (fstat(file, &status) != 0 || status.st_size == 0) {
+    close(file);
+    return false;
+  }
+  void* data = mmap(
+    nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE,
+    file, 0);
+  // The mapping keeps its own reference to the file.
+  close(file);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  // The stages read the rows in order.
+  madvise(data, static_cast<size_t>(status.st_size), MADV_SEQUENTIAL);
+  size_ = static_cast<size_t>(status.st_size);
+#endif
+  data_ = static_cast<const uint8_t*>(data);
+  return true;
+}
+
+void MappedImage::Close() {
+  if (data_) {
+#if defined(_WIN32)
+    UnmapViewOfFile(data_);
+    CloseHandle(static_cast<HANDLE>(mapping_));
+    CloseHandle(static_cast<HANDLE>(file_));
+    mapping_ = nullptr;
+    file_ = nullptr;
+#else
+    munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+  }
+  data_ = nullptr;
+  size_ = 0;
+  pixels_ = nullptr;
+  width_ = 0;
+  height_ = 0;
+  channels_ = 0;
+  sample_bytes_ = 1;
+}
+
+bool MappedImage::OpenPnm(const std::string& path) {
+  if (!Map(path)) {
+    return false;
+  }
+  // Header: magic, width, height and maximum value separated by whitespace
+  // or comments, then a single whitespace before the pixels.
+  size_t offset = 2;
+  auto read_number = [&](int64_t& value) {
+    while (offset < size_) {
+      if (data_[offset] == '#') {
+        while (offset < size_ && data_[offset] != '\n') {
+          ++offset;
+        }
+      } else if (std::isspace(data_[offset])) {
+        ++offset;
+      } else {
+        break;
+      }
+    }
+    if (offset == size_ || !std::isdigit(data_[offset])) {
+      return false;
+    }
+    value = 0;
+    while (offset < size_ && std::isdigit(data_[offset]) &&
+           value < (int64_t(1)<<31)) {
+      value = value*10+(data_[offset++]-'0');
+    }
+    return true;
+  };
+  int64_t width;
+  int64_t height;
+  int64_t max_value;
+  if (size_ < 2 || data_[0] != 'P' || (data_[1] != '5' && data_[1] != '6') ||
+      !read_number(width) || !read_number(height) ||
+      !read_number(max_value) || offset == size_ ||
+      !std::isspace(data_[offset])) {
+    Close();
+    return false;
+  }
+  ++offset;
+  const int32_t channels = data_[1] == '6' ? 3 : 1;
+  const int32_t sample_bytes = max_value > 255 ? 2 : 1;
+  // Only the sides have to fit in 32 bits, the tiled mode reading images
+  // of any area. width*height stays below 2^62.
+  const int64_t kMaxSide = (int64_t(1)<<31)-1;
+  if (width <= 0 || height <= 0 || width > kMaxSide || height > kMaxSide ||
+      max_value <= 0 || max_value > 65535 ||
+      uint64_t(width*height) > (size_-offset)/(channels*sample_bytes)) {
+    Close();
+    return false;
+  }
+  pixels_ = data_+offset;
+  width_ = static_cast<int32_t>(width);
+  height_ = static_cast<int32_t>(height);
+  channels_ = channels;
+  sample_bytes_ = sample_bytes;
+  return true;
+}
+
+bool MappedImage::OpenRaw(
+    const std::string& path, int32_t width, int32_t height,
+    int32_t channels) {
+  if (width <= 0 || height <= 0 || (channels != 1 && channels != 3) ||
+      !Map(path)) {
+    return false;
+  }
+  if (size_ != size_t(width)*height*channels) {
+    Close();
+    return false;
+  }
+  pixels_ = data_;
+  width_ = width;
+  height_ = height;
+  channels_ = channels;
+  return true;
+}
@@ -0,0 +1,70 @@
+#ifndef PRACTICAL_MARKED_MAPPED_IMAGE_H_
+#define PRACTICAL_MARKED_MAPPED_IMAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only view of an uncompressed image file mapped in memory. The pixels
+// are used in place, so opening a file costs no decoding and no copy, and
+// the pages are only read from the disk when a stage touches them.
+class MappedImage {
+ public:
+  MappedImage() = default;
+  ~MappedImage() {
+    Close();
+  }
+
+  MappedImage(const MappedImage&) = delete;
+  MappedImage& operator=(const MappedImage&) = delete;
+
+  // Maps a binary PPM (P6, RGB) or PGM (P5, gray) file. The samples take 2
+  // big-endian bytes when the maximum value is over 255, which only
+  // DecodeImage converts. Returns false when the file is missing or not one
+  // of these formats.
+  bool OpenPnm(const std::string& path);
+
+  // Maps a headerless file of width*height pixels with `channels` bytes
+  // each. Returns false when the file size does not match.
+  bool OpenRaw(
+    const std::string& path, int32_t width, int32_t height,
+    int32_t channels);
+
+  void Close();
+
+  bool is_open() const {
+    return pixels_ != nullptr;
+  }
+  const uint8_t* pixels() const {
+    return pixels_;
+  }
+  int32_t width() const {
+    return width_;
+  }
+  int32_t height() const {
+    return height_;
+  }
+  int32_t channels() const {
+    return channels_;
+  }
+  int32_t sample_bytes() const {
+    return sample_bytes_;
+  }
+
+ private:
+  bool Map(const std::string& path);
+
+  const uint8_t* data_ = nullptr;  // Whole file
+  size_t size_ = 0;
+  const uint8_t* pixels_ = nullptr;  // First pixel inside data_
+  int32_t width_ = 0;
+  int32_t height_ = 0;
+  int32_t channels_ = 0;
+  int32_t sample_bytes_ = 1;
+#if defined(_WIN32)
+  void* file_ = nullptr;
+  void* mapping_ = nullptr;
+#endif
+};
+
+#endif  // PRACTICAL_MARKED_MAPPED_IMAGE_H_
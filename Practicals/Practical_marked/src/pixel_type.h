@@ -0,0 +1,68 @@
+#ifndef PRACTICAL_MARKED_PIXEL_TYPE_H_
+#define PRACTICAL_MARKED_PIXEL_TYPE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Type of the samples of an input image.
+enum class PixelType {
+  kU8,   // 8-bit, 0 to 255
+  kU16,  // 16-bit PNG and PNM files, 0 to 65535
+  kF32   // Radiance HDR files, 1.0 is the white point
+};
+
+// Arithmetic of a sample type. Sum holds stencil sums of samples exactly
+// for the integer types, Square holds Gx*Gx+Gy*Gy, BoxSum the running sums
+// of the box blur up to kMaxBlurRadius, and kScale maps the 8-bit levels of
+// level_threshold_ to the range of the samples, so an image stretched to 16
+// bits keeps its edges.
+template <typename T>
+struct PixelTraits;
+
+template <>
+struct PixelTraits<uint8_t> {
+  using Sum = int32_t;
+  using Square = int32_t;
+  using BoxSum = uint32_t;
+  static constexpr PixelType kType = PixelType::kU8;
+  static constexpr int32_t kScale = 1;
+};
+
+template <>
+struct PixelTraits<uint16_t> {
+  using Sum = int32_t;
+  using Square = int64_t;  // |Gx| and |Gy| reach 4*65535
+  using BoxSum = uint64_t;
+  static constexpr PixelType kType = PixelType::kU16;
+  static constexpr int32_t kScale = 257;
+};
+
+template <>
+struct PixelTraits<float> {
+  using Sum = float;
+  using Square = float;
+  using BoxSum = double;  // Keeps the running sums from drifting
+  static constexpr PixelType kType = PixelType::kF32;
+  static constexpr float kScale = 1.0f/255.0f;
+};
+
+inline size_t PixelSize(PixelType type) {
+  switch (type) {
+    case PixelType::kU16: return sizeof(uint16_t);
+    case PixelType::kF32: return sizeof(float);
+    default: return sizeof(uint8_t);
+  }
+}
+
+// Calls visit(uint8_t()), visit(uint16_t()) or visit(float()), turning the
+// runtime type into a type the stages are instantiated on.
+template <typename Visitor>
+void WithPixelType(PixelType type, const Visitor& visit) {
+  switch (type) {
+    case PixelType::kU16: visit(uint16_t()); break;
+    case PixelType::kF32: visit(float()); break;
+    default: visit(uint8_t()); break;
+  }
+}
+
+#endif  // PRACTICAL_MARKED_PIXEL_TYPE_H_
@@ -0,0 +1,167 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <unordered_map>
+
+namespace {
+
+// Threads are numbered in the order they first record a span, so the trace
+// shows small stable ids instead of hashed std::thread ids.
+uint32_t ThreadIndex() {
+  static std::atomic<uint32_t> next_thread{0};
+  thread_local const uint32_t index =
+    next_thread.fetch_add(1, std::memory_order_relaxed);
+  return index;
+}
+
+// Quoted name, with its quotes and backslashes escaped.
+void JsonString(std::ostream& out, const char* text) {
+  out << '"';
+  for (; *text; ++text) {
+    if (*text == '"' || *text == '\\') {
+      out << '\\';
+    }
+    out << *text;
+  }
+  out << '"';
+}
+
+}  // namespace
+
+Profiler::Profiler(size_t capacity)
+    : start_(std::chrono::steady_clock::now()) {
+  size_t size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+  slots_ = std::vector<Slot>(size);
+  mask_ = size-1;
+}
+
+void Profiler::Record(const char* name, int64_t begin, int64_t end) {
+  const uint64_t index = next_.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = slots_[index&mask_];
+  slot.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.thread.store(ThreadIndex(), std::memory_order_relaxed);
+  slot.begin.store(begin, std::memory_order_relaxed);
+  slot.duration.store(end-begin, std::memory_order_relaxed);
+  slot.sequence.store(index+1, std::memory_order_release);
+}
+
+std::vector<ProfileEvent> Profiler::Events() const {
+  const uint64_t end = next_.load(std::memory_order_acquire);
+  const uint64_t begin = end > capacity() ? end-capacity() : 0;
+  std::vector<ProfileEvent> events;
+  events.reserve(end-begin);
+  for (uint64_t index=begin; index<end; ++index) {
+    const Slot& slot = slots_[index&mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != index+1) {
+      continue;
+    }
+    ProfileEvent event;
+    event.name = slot.name.load(std::memory_order_relaxed);
+    event.thread = slot.thread.load(std::memory_order_relaxed);
+    event.begin = slot.begin.load(std::memory_order_relaxed);
+    event.duration = slot.duration.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) == index+1) {
+      events.push_back(event);
+    }
+  }
+  return events;
+}
+
+uint64_t Profiler::dropped() const {
+  const uint64_t recorded = next_.load(std::memory_order_relaxed);
+  return recorded > capacity() ? recorded-capacity() : 0;
+}
+
+void Profiler::Clear() {
+  for (Slot& slot : slots_) {
+    slot.sequence.store(0, std::memory_order_relaxed);
+  }
+  next_.store(0, std::memory_order_release);
+}
+
+std::vector<ProfileSummary> SummarizeProfile(
+    const std::vector<ProfileEvent>& events) {
+  std::vector<ProfileSummary> summaries;
+  std::vector<std::vector<int64_t>> durations;
+  // Names are compared as strings, the same literal having different
+  // addresses in different translation units.
+  std::unordered_map<std::string, size_t> indices;
+  for (const ProfileEvent& event : events) {
+    const auto found = indices.emplace(event.name, summaries.size());
+    if (found.second) {
+      summaries.emplace_back();
+      summaries.back().name = event.name;
+      durations.emplace_back();
+    }
+    durations[found.first->second].push_back(event.duration);
+  }
+  for (size_t i=0; i<summaries.size(); ++i) {
+    std::vector<int64_t>& sorted = durations[i];
+    std::sort(sorted.begin(), sorted.end());
+    // Nearest rank: the smallest duration at or above p percent of them.
+    auto percentile = [&](double p) {
+      const size_t rank = static_cast<size_t>(
+        std::ceil(p/100.0*static_cast<double>(sorted.size())));
+      return sorted[std::max<size_t>(rank, 1)-1]*1e-6;
+    };
+    ProfileSummary& summary = summaries[i];
+    summary.count = sorted.size();
+    summary.p50 = percentile(50.0);
+    summary.p95 = percentile(95.0);
+    summary.p99 = percentile(99.0);
+    for (const int64_t duration : sorted) {
+      summary.total += duration*1e-6;
+    }
+  }
+  return summaries;
+}
+
+void PrintProfile(std::ostream& out, const std::vector<ProfileEvent>& events) {
+  const std::vector<ProfileSummary> summaries = SummarizeProfile(events);
+  size_t width = 5;
+  for (const ProfileSummary& summary : summaries) {
+    width = std::max(width, summary.name.size());
+  }
+  const std::ios_base::fmtflags flags = out.flags();
+  const std::streamsize precision = out.precision();
+  out << std::left << std::setw(width) << "stage" << std::right
+    << std::setw(8) << "count" << std::setw(11) << "p50 ms"
+    << std::setw(11) << "p95 ms" << std::setw(11) << "p99 ms"
+    << std::setw(12) << "total ms" << '\n' << std::fixed
+    << std::setprecision(3);
+  for (const ProfileSummary& summary : summaries) {
+    out << std::left << std::setw(width) << summary.name << std::right
+      << std::setw(8) << summary.count << std::setw(11) << summary.p50
+      << std::setw(11) << summary.p95 << std::setw(11) << summary.p99
+      << std::setw(12) << summary.total << '\n';
+  }
+  out.flags(flags);
+  out.precision(precision);
+}
+
+bool WriteChromeTrace(
+    const std::string& path, const std::vector<ProfileEvent>& events) {
+  std::ofstream file(path);
+  // The trace format counts in microseconds, fractions allowed.
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::fixed
+    << std::setprecision(3);
+  for (size_t i=0; i<events.size(); ++i) {
+    const ProfileEvent& event = events[i];
+    file << (i ? ",\n" : "\n") << "{\"name\":";
+    JsonString(file, event.name);
+    file << ",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread
+      << ",\"ts\":" << event.begin*1e-3 << ",\"dur\":" << event.duration*1e-3
+      << '}';
+  }
+  file << "\n]}\n";
+  return static_cast<bool>(file);
+}
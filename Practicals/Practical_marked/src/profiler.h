@@ -0,0 +1,117 @@
+#ifndef PRACTICAL_MARKED_PROFILER_H_
+#define PRACTICAL_MARKED_PROFILER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Span of a scoped timer, in nanoseconds since the start of its profiler.
+struct ProfileEvent {
+  const char* name;  // Static string, usually the name of a stage
+  uint32_t thread;   // Small index of the recording thread
+  int64_t begin;
+  int64_t duration;
+};
+
+// Timings of the spans of one name, in milliseconds.
+struct ProfileSummary {
+  std::string name;
+  size_t count = 0;
+  double p50 = 0.0;
+  double p95 = 0.0;
+  double p99 = 0.0;
+  double total = 0.0;
+};
+
+// Lock-free ring of the last capacity() spans recorded by any number of
+// threads. A writer claims a slot with a single fetch_add and publishes it
+// with a sequence number, so recording never blocks and never allocates,
+// and the oldest spans are overwritten once the ring is full. Events reads
+// the slots like a seqlock and skips the ones being rewritten, so it only
+// misses spans when it runs concurrently with the writers.
+class Profiler {
+ public:
+  // The capacity is rounded up to a power of two.
+  explicit Profiler(size_t capacity = 1<<16);
+
+  Profiler(const Profiler&) = delete;
+  Profiler& operator=(const Profiler&) = delete;
+
+  size_t capacity() const {
+    return mask_+1;
+  }
+
+  // Nanoseconds since the profiler was created.
+  int64_t Now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now()-start_).count();
+  }
+
+  void Record(const char* name, int64_t begin, int64_t end);
+
+  // Spans recorded so far, oldest first.
+  std::vector<ProfileEvent> Events() const;
+
+  // Spans overwritten before they could be read.
+  uint64_t dropped() const;
+
+  void Clear();
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> sequence{0};  // Index+1 of the span, 0 while written
+    std::atomic<const char*> name{nullptr};
+    std::atomic<uint32_t> thread{0};
+    std::atomic<int64_t> begin{0};
+    std::atomic<int64_t> duration{0};
+  };
+
+  std::vector<Slot> slots_;
+  size_t mask_ = 0;
+  alignas(64) std::atomic<uint64_t> next_{0};
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Records the span from its construction to its destruction under name,
+// which must outlive the profiler. Does nothing when profiler is null, so
+// the stages can be timed unconditionally.
+class ScopedTimer {
+ public:
+  ScopedTimer(Profiler* profiler, const char* name)
+      : profiler_(profiler), name_(name),
+        begin_(profiler ? profiler->Now() : 0) {}
+
+  ~ScopedTimer() {
+    if (profiler_) {
+      profiler_->Record(name_, begin_, profiler_->Now());
+    }
+  }
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+ private:
+  Profiler* profiler_;
+  const char* name_;
+  int64_t begin_;
+};
+
+// Nearest-rank percentiles of the spans of every name, in order of first
+// appearance.
+std::vector<ProfileSummary> SummarizeProfile(
+  const std::vector<ProfileEvent>& events);
+
+// One line per name: count, p50, p95, p99 and total milliseconds.
+void PrintProfile(std::ostream& out, const std::vector<ProfileEvent>& events);
+
+// Writes events as complete ("X") events of the Chrome trace format, which
+// chrome://tracing and Perfetto open. Returns false when the file cannot be
+// written.
+bool WriteChromeTrace(
+  const std::string& path, const std::vector<ProfileEvent>& events);
+
+#endif  // PRACTICAL_MARKED_PROFILER_H_
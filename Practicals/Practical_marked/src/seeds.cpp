@@ -0,0 +1,156 @@
+#include "seeds.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "simd.h"
+
+// Non-edge pixels of a mask numbered in raster order. Their number in every
+// row is counted once, so the pixel of a given rank is found with a binary
+// search over the rows and a scan of a single row.
+class FreePixels {
+ public:
+  FreePixels(const EdgeMask& mask, FrameArena& arena) : mask_(mask) {
+    row_starts_ = arena.Allocate<uint32_t>(mask.height+1);
+    row_starts_[0] = 0;
+    for (int32_t y=0; y<mask.height; ++y) {
+      const uint64_t* row = mask.Row(y);
+      uint32_t free_count = 0;
+      for (int32_t word=0; word<mask.words_per_row; ++word) {
+        free_count += PopCount(~row[word]);
+      }
+      row_starts_[y+1] = row_starts_[y]+free_count;
+    }
+  }
+
+  uint32_t count() const {
+    return row_starts_[mask_.height];
+  }
+
+  // Pixel of rank `rank` < count().
+  std::pair<int32_t, int32_t> Select(uint32_t rank) const {
+    const int32_t y = static_cast<int32_t>(
+      std::upper_bound(row_starts_, row_starts_+mask_.height+1, rank)-
+      row_starts_)-1;
+    rank -= row_starts_[y];
+    const uint64_t* row = mask_.Row(y);
+    for (int32_t word=0; ; ++word) {
+      uint64_t free_bits = ~row[word];
+      const uint32_t free_count = PopCount(free_bits);
+      if (rank < free_count) {
+        for (uint32_t i=0; i<rank; ++i) {
+          free_bits &= free_bits-1;
+        }
+        return {word*64+EdgeMask::CountTrailingZeros(free_bits), y};
+      }
+      rank -= free_count;
+    }
+  }
+
+  // Uniform non-edge pixel from 64 random bits.
+  std::pair<int32_t, int32_t> Draw(uint64_t random) const {
+    return Select(static_cast<uint32_t>(((random>>32)*count())>>32));
+  }
+
+ private:
+  const EdgeMask& mask_;
+  uint32_t* row_starts_;  // Rank of the first non-edge pixel of each row
+};
+
+void PlaceSeeds(
+    const EdgeMask& mask, int32_t count, uint64_t rng_seed,
+    SeedPlacement placement, FrameArena& arena,
+    std::vector<std::pair<int32_t, int32_t>>& seeds) {
+  seeds.clear();
+  const FreePixels free_pixels(mask, arena);
+  const uint32_t target =
+    std::min(static_cast<uint32_t>(std::max(count, 0)), free_pixels.count());
+  if (target == 0) {
+    return;
+  }
+
+  // One bit per pixel holding a seed, so no pixel gets two.
+  const int32_t width = mask.width;
+  const size_t taken_words = (size_t(width)*mask.height+63)/64;
+  uint64_t* taken = arena.Allocate<uint64_t>(taken_words);
+  std::fill(taken, taken+taken_words, 0u);
+  auto take = [&](std::pair<int32_t, int32_t> pixel) {
+    const size_t index = size_t(pixel.second)*width+pixel.first;
+    const uint64_t bit = uint64_t(1)<<(index&63);
+    if (taken[index>>6]&bit) {
+      return false;
+    }
+    taken[index>>6] |= bit;
+    seeds.push_back(pixel);
+    return true;
+  };
+  uint64_t counter = 0;
+
+  if (placement == SeedPlacement::kPoissonDisk) {
+    // Dart throwing: a candidate closer than radius to a seed is rejected.
+    // The grid cells have a diagonal of radius, so they hold one seed at
+    // most and only the 5x5 cells around a candidate are checked. After
+    // too many rejections in a row the radius shrinks, the seeds already
+    // placed staying valid, so the count is always met. The start radius
+    // is about what random darts fill before saturating.
+    const int32_t kMaxRejections = 64;
+    float radius =
+      0.75f*std::sqrt(static_cast<float>(free_pixels.count())/target);
+    while (seeds.size() < target && radius >= 1.0f) {
+      const float cell = radius/std::sqrt(2.0f);
+      const int32_t grid_width = static_cast<int32_t>(width/cell)+1;
+      const int32_t grid_height = static_cast<int32_t>(mask.height/cell)+1;
+      int32_t* grid = arena.Allocate<int32_t>(size_t(grid_width)*grid_height);
+      std::fill(grid, grid+size_t(grid_width)*grid_height, -1);
+      auto grid_cell = [&](std::pair<int32_t, int32_t> pixel) {
+        return std::make_pair(
+          static_cast<int32_t>(pixel.first/cell),
+          static_cast<int32_t>(pixel.second/cell));
+      };
+      for (size_t s=0; s<seeds.size(); ++s) {
+        const std::pair<int32_t, int32_t> xy = grid_cell(seeds[s]);
+        grid[xy.second*grid_width+xy.first] = static_cast<int32_t>(s);
+      }
+
+      const float squared_radius = radius*radius;
+      int32_t rejections = 0;
+      while (seeds.size() < target && rejections < kMaxRejections) {
+        const std::pair<int32_t, int32_t> pixel =
+          free_pixels.Draw(CounterRandom(rng_seed, counter++));
+        const std::pair<int32_t, int32_t> xy = grid_cell(pixel);
+        bool too_close = false;
+        for (int32_t gy=std::max(xy.second-2, 0);
+             gy<=std::min(xy.second+2, grid_height-1) && !too_close; ++gy) {
+          for (int32_t gx=std::max(xy.first-2, 0);
+               gx<=std::min(xy.first+2, grid_width-1); ++gx) {
+            const int32_t other = grid[gy*grid_width+gx];
+            if (other < 0) {
+              continue;
+            }
+            const float dx = static_cast<float>(seeds[other].first-pixel.first);
+            const float dy =
+              static_cast<float>(seeds[other].second-pixel.second);
+            if (dx*dx+dy*dy < squared_radius) {
+              too_close = true;
+              break;
+            }
+          }
+        }
+        if (too_close || !take(pixel)) {
+          ++rejections;
+          continue;
+        }
+        grid[xy.second*grid_width+xy.first] =
+          static_cast<int32_t>(seeds.size()-1);
+        rejections = 0;
+      }
+      radius *= 0.75f;
+    }
+  }
+
+  // Uniform placement, and the end of a Poisson-disk placement whose radius
+  // fell under a pixel.
+  while (seeds.size() < target) {
+    take(free_pixels.Draw(CounterRandom(rng_seed, counter++)));
+  }
+}
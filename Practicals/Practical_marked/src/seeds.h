@@ -0,0 +1,34 @@
+#ifndef PRACTICAL_MARKED_SEEDS_H_
+#define PRACTICAL_MARKED_SEEDS_H_
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "edge_mask.h"
+#include "frame_arena.h"
+
+enum class SeedPlacement {
+  kUniform,     // Independent uniform positions
+  kPoissonDisk  // Blue noise: no two seeds closer than a radius
+};
+
+// Counter-based generator: value `counter` of the stream `key` is a hash of
+// both, so any draw is reproducible on its own and costs a few multiplies.
+inline uint64_t CounterRandom(uint64_t key, uint64_t counter) {
+  uint64_t z = key+(counter+1)*0x9E3779B97F4A7C15u;  // SplitMix64
+  z = (z^(z>>30))*0xBF58476D1CE4E5B9u;
+  z = (z^(z>>27))*0x94D049BB133111EBu;
+  return z^(z>>31);
+}
+
+// Fills seeds with `count` distinct pixels that are not edges of mask, or
+// with every such pixel when there are fewer. The positions only depend on
+// the mask, the count, rng_seed and the placement. The candidates are drawn
+// among the non-edge pixels directly, so no draw is lost on an edge.
+void PlaceSeeds(
+  const EdgeMask& mask, int32_t count, uint64_t rng_seed,
+  SeedPlacement placement, FrameArena& arena,
+  std::vector<std::pair<int32_t, int32_t>>& seeds);
+
+#endif  // PRACTICAL_MARKED_SEEDS_H_
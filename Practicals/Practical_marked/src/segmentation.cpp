@@ -0,0 +1,2557 @@
+#include "segmentation.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <type_traits>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+bool HasExtension(const std::string& path, const char* extension) {
+  const size_t length = std::char_traits<char>::length(extension);
+  if (path.size() < length) {
+    return false;
+  }
+  for (size_t i=0; i<length; ++i) {
+    const char c = path[path.size()-length+i];
+    if (std::tolower(static_cast<unsigned char>(c)) != extension[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// PNM files store their 16-bit samples big-endian, and stb only reads 8-bit
+// ones. Gray is repeated to RGB, as stb does for the other formats.
+bool DecodePnm16(
+    const std::string& path, int32_t& width, int32_t& height,
+    std::vector<uint8_t>& rgb) {
+  MappedImage mapped;
+  if (!mapped.OpenPnm(path) || mapped.sample_bytes() != 2 ||
+      !FitsWholeImage(mapped.width(), mapped.height(), 3)) {
+    return false;
+  }
+  width = mapped.width();
+  height = mapped.height();
+  const int32_t channels = mapped.channels();
+  const size_t count = size_t(width)*height;
+  rgb.resize(count*3*sizeof(uint16_t));
+  uint16_t* samples = reinterpret_cast<uint16_t*>(rgb.data());
+  const uint8_t* bytes = mapped.pixels();
+  for (size_t i=0; i<count; ++i) {
+    for (int32_t c=0; c<3; ++c) {
+      const uint8_t* sample = bytes+(i*channels+(channels == 3 ? c : 0))*2;
+      samples[i*3+c] = static_cast<uint16_t>((sample[0]<<8)|sample[1]);
+    }
+  }
+  return true;
+}
+
+bool DecodeImage(
+    const std::string& path, int32_t& width, int32_t& height,
+    std::vector<uint8_t>& rgb, PixelType& type) {
+  if ((HasExtension(path, ".ppm") || HasExtension(path, ".pgm") ||
+       HasExtension(path, ".pnm")) &&
+      DecodePnm16(path, width, height, rgb)) {
+    type = PixelType::kU16;
+    return true;
+  }
+  // The size is read from the header, so an image too large is rejected
+  // before stb allocates it.
+  int32_t planes;
+  if (!stbi_info(path.c_str(), &width, &height, &planes) ||
+      !FitsWholeImage(width, height, 3)) {
+    return false;
+  }
+  void* image_data_raw;
+  if (stbi_is_hdr(path.c_str())) {
+    type = PixelType::kF32;
+    image_data_raw = stbi_loadf(path.c_str(), &width, &height, &planes, 3);
+  } else if (stbi_is_16_bit(path.c_str())) {
+    type = PixelType::kU16;
+    image_data_raw = stbi_load_16(path.c_str(), &width, &height, &planes, 3);
+  } else {
+    type = PixelType::kU8;
+    image_data_raw = stbi_load(path.c_str(), &width, &height, &planes, 3);
+  }
+  if (!image_data_raw) {
+    return false;
+  }
+  const uint8_t* bytes = static_cast<const uint8_t*>(image_data_raw);
+  rgb.assign(bytes, bytes+size_t(width)*height*3*PixelSize(type));
+  stbi_image_free(image_data_raw);
+  return true;
+}
+
+// Leaves an empty image, so image_pixels_ never outlives the buffer or the
+// mapping it pointed to.
+bool ClearInput(Content& content) {
+  content.mapped_image_.Close();
+  content.image_original_.clear();
+  content.image_pixels_ = nullptr;
+  content.image_channels_ = 3;
+  content.image_pixel_type_ = PixelType::kU8;
+  content.width = 0;
+  content.height = 0;
+  ++content.image_version_;
+  return false;
+}
+
+bool UseMappedImage(Content& content) {
+  const MappedImage& mapped = content.mapped_image_;
+  if (!FitsWholeImage(mapped.width(), mapped.height(), mapped.channels())) {
+    return ClearInput(content);
+  }
+  content.width = mapped.width();
+  content.height = mapped.height();
+  content.image_pixels_ = mapped.pixels();
+  content.image_channels_ = mapped.channels();
+  content.image_pixel_type_ = PixelType::kU8;
+  // The decoded copy is no longer needed, do not keep both resident.
+  content.image_original_.clear();
+  content.image_original_.shrink_to_fit();
+  ++content.image_version_;
+  return true;
+}
+
+bool LoadImage(Content& content, const std::string& path) {
+  if (HasExtension(path, ".ppm") || HasExtension(path, ".pgm") ||
+      HasExtension(path, ".pnm")) {
+    if (content.mapped_image_.OpenPnm(path)) {
+      if (content.mapped_image_.sample_bytes() == 1) {
+        return UseMappedImage(content);
+      }
+      content.mapped_image_.Close();
+    }
+    // ASCII and 16-bit files are decoded.
+  }
+  int32_t width;
+  int32_t height;
+  std::vector<uint8_t> rgb;
+  PixelType type;
+  if (!DecodeImage(path, width, height, rgb, type)) {
+    return ClearInput(content);
+  }
+  SetImage(content, width, height, rgb, type);
+  return true;
+}
+
+bool LoadRawImage(
+    Content& content, const std::string& path, int32_t width, int32_t height,
+    int32_t channels) {
+  if (!content.mapped_image_.OpenRaw(path, width, height, channels)) {
+    return ClearInput(content);
+  }
+  return UseMappedImage(content);
+}
+
+void SetImage(
+    Content& content, int32_t width, int32_t height,
+    std::vector<uint8_t>& rgb, PixelType type) {
+  content.mapped_image_.Close();
+  content.width = width;
+  content.height = height;
+  content.image_original_.swap(rgb);
+  content.image_pixels_ = content.image_original_.data();
+  content.image_channels_ = 3;
+  content.image_pixel_type_ = type;
+  ++content.image_version_;
+}
+
+// The grayscale value is (r+g+b)/3, in the type of the samples. For 8-bit
+// samples the sum is at most 765, so the division is exactly
+// (sum*0xAAAB)>>17, which the SIMD kernels compute as a 16-bit high multiply
+// followed by a shift.
+template <typename T>
+void GrayscaleScalar(const T* color, T* grayscale, int32_t count) {
+  for (int32_t i=0; i<count; ++i) {
+    const typename PixelTraits<T>::Sum sum =
+      color[i*3+0]+color[i*3+1]+color[i*3+2];
+    grayscale[i] = static_cast<T>(sum/3);
+  }
+}
+
+#if SIMD_X86
+// Shuffles gathering the R, G and B bytes of 16 packed RGB24 pixels spread
+// over three 16-byte registers. -1 entries produce a zero byte.
+alignas(16) const int8_t kDeinterleaveRGB[9][16] = {
+  { 0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13},
+  { 1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14},
+  { 2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15}
+};
+
+// Same for the 8 pixels of 16-bit samples and the 4 pixels of float samples
+// held by 48 bytes, moving 2 and 4 bytes per sample.
+alignas(16) const int8_t kDeinterleaveRGB16[9][16] = {
+  { 0,  1,  6,  7, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1,  2,  3,  8,  9, 14, 15, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  4,  5, 10, 11},
+  { 2,  3,  8,  9, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1,  4,  5, 10, 11, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  1,  6,  7, 12, 13},
+  { 4,  5, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1,  0,  1,  6,  7, 12, 13, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  3,  8,  9, 14, 15}
+};
+
+alignas(16) const int8_t kDeinterleaveRGB32[9][16] = {
+  { 0,  1,  2,  3, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1,  8,  9, 10, 11, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  4,  5,  6,  7},
+  { 4,  5,  6,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1,  0,  1,  2,  3, 12, 13, 14, 15, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  8,  9, 10, 11},
+  { 8,  9, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1,  4,  5,  6,  7, -1, -1, -1, -1, -1, -1, -1, -1},
+  {-1, -1, -1, -1, -1, -1, -1, -1,  0,  1,  2,  3, 12, 13, 14, 15}
+};
+
+// R, G and B of the pixels held by a, b and c, through the shuffles of one
+// of the tables above.
+SIMD_TARGET_SSE41
+inline void DeinterleaveSSE41(
+    __m128i a, __m128i b, __m128i c, const int8_t (*table)[16],
+    __m128i* channel) {
+  for (int32_t k=0; k<3; ++k) {
+    const __m128i* shuffle = reinterpret_cast<const __m128i*>(table[k*3]);
+    channel[k] = _mm_or_si128(
+      _mm_or_si128(
+        _mm_shuffle_epi8(a, _mm_load_si128(shuffle+0)),
+        _mm_shuffle_epi8(b, _mm_load_si128(shuffle+1))),
+      _mm_shuffle_epi8(c, _mm_load_si128(shuffle+2)));
+  }
+}
+
+SIMD_TARGET_SSE41
+void GrayscaleSSE41(const uint8_t* color, uint8_t* grayscale, int32_t count) {
+  __m128i shuffle[9];
+  for (int32_t i=0; i<9; ++i) {
+    shuffle[i] = _mm_load_si128(
+      reinterpret_cast<const __m128i*>(kDeinterleaveRGB[i]));
+  }
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one_third = _mm_set1_epi16(static_cast<int16_t>(0xAAAB));
+  int32_t i = 0;
+  for (; i+16<=count; i+=16) {
+    const __m128i* source = reinterpret_cast<const __m128i*>(color+i*3);
+    const __m128i a = _mm_loadu_si128(source+0);
+    const __m128i b = _mm_loadu_si128(source+1);
+    const __m128i c = _mm_loadu_si128(source+2);
+    __m128i channel[3];
+    for (int32_t k=0; k<3; ++k) {
+      channel[k] = _mm_or_si128(
+        _mm_or_si128(
+          _mm_shuffle_epi8(a, shuffle[k*3+0]),
+          _mm_shuffle_epi8(b, shuffle[k*3+1])),
+        _mm_shuffle_epi8(c, shuffle[k*3+2]));
+    }
+    __m128i sum_low = _mm_add_epi16(
+      _mm_add_epi16(
+        _mm_unpacklo_epi8(channel[0], zero),
+        _mm_unpacklo_epi8(channel[1], zero)),
+      _mm_unpacklo_epi8(channel[2], zero));
+    __m128i sum_high = _mm_add_epi16(
+      _mm_add_epi16(
+        _mm_unpackhi_epi8(channel[0], zero),
+        _mm_unpackhi_epi8(channel[1], zero)),
+      _mm_unpackhi_epi8(channel[2], zero));
+    sum_low = _mm_srli_epi16(_mm_mulhi_epu16(sum_low, one_third), 1);
+    sum_high = _mm_srli_epi16(_mm_mulhi_epu16(sum_high, one_third), 1);
+    _mm_storeu_si128(
+      reinterpret_cast<__m128i*>(grayscale+i),
+      _mm_packus_epi16(sum_low, sum_high));
+  }
+  GrayscaleScalar(color+i*3, grayscale+i, count-i);
+}
+
+SIMD_TARGET_AVX2
+inline __m256i LoadLanesAVX2(const uint8_t* low, const uint8_t* high) {
+  return _mm256_inserti128_si256(
+    _mm256_castsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(low))),
+    _mm_loadu_si128(reinterpret_cast<const __m128i*>(high)),
+    1);
+}
+
+// Each 128-bit lane holds its own group of 16 pixels, so the in-lane
+// shuffles, unpacks and pack of the SSE4.1 kernel keep the pixel order.
+SIMD_TARGET_AVX2
+void GrayscaleAVX2(const uint8_t* color, uint8_t* grayscale, int32_t count) {
+  __m256i shuffle[9];
+  for (int32_t i=0; i<9; ++i) {
+    shuffle[i] = _mm256_broadcastsi128_si256(_mm_load_si128(
+      reinterpret_cast<const __m128i*>(kDeinterleaveRGB[i])));
+  }
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one_third = _mm256_set1_epi16(static_cast<int16_t>(0xAAAB));
+  int32_t i = 0;
+  for (; i+32<=count; i+=32) {
+    const uint8_t* source = color+i*3;
+    const __m256i a = LoadLanesAVX2(source+0, source+48);
+    const __m256i b = LoadLanesAVX2(source+16, source+64);
+    const __m256i c = LoadLanesAVX2(source+32, source+80);
+    __m256i channel[3];
+    for (int32_t k=0; k<3; ++k) {
+      channel[k] = _mm256_or_si256(
+        _mm256_or_si256(
+          _mm256_shuffle_epi8(a, shuffle[k*3+0]),
+          _mm256_shuffle_epi8(b, shuffle[k*3+1])),
+        _mm256_shuffle_epi8(c, shuffle[k*3+2]));
+    }
+    __m256i sum_low = _mm256_add_epi16(
+      _mm256_add_epi16(
+        _mm256_unpacklo_epi8(channel[0], zero),
+        _mm256_unpacklo_epi8(channel[1], zero)),
+      _mm256_unpacklo_epi8(channel[2], zero));
+    __m256i sum_high = _mm256_add_epi16(
+      _mm256_add_epi16(
+        _mm256_unpackhi_epi8(channel[0], zero),
+        _mm256_unpackhi_epi8(channel[1], zero)),
+      _mm256_unpackhi_epi8(channel[2], zero));
+    sum_low = _mm256_srli_epi16(_mm256_mulhi_epu16(sum_low, one_third), 1);
+    sum_high = _mm256_srli_epi16(_mm256_mulhi_epu16(sum_high, one_third), 1);
+    _mm256_storeu_si256(
+      reinterpret_cast<__m256i*>(grayscale+i),
+      _mm256_packus_epi16(sum_low, sum_high));
+  }
+  GrayscaleSSE41(color+i*3, grayscale+i, count-i);
+}
+
+// 16-bit sums reach 3*65535, so they are added in 32 bits and divided as
+// floats: a float holds them exactly and its rounded quotient stays below
+// the next integer, so truncating it is the integer division.
+SIMD_TARGET_SSE41
+inline __m128i DivideBy3SSE41(__m128i sum) {
+  return _mm_cvttps_epi32(
+    _mm_div_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(3.0f)));
+}
+
+SIMD_TARGET_SSE41
+void GrayscaleSSE41(
+    const uint16_t* color, uint16_t* grayscale, int32_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  int32_t i = 0;
+  for (; i+8<=count; i+=8) {
+    const __m128i* source = reinterpret_cast<const __m128i*>(color+i*3);
+    __m128i channel[3];
+    DeinterleaveSSE41(
+      _mm_loadu_si128(source+0), _mm_loadu_si128(source+1),
+      _mm_loadu_si128(source+2), kDeinterleaveRGB16, channel);
+    const __m128i sum_low = _mm_add_epi32(
+      _mm_add_epi32(
+        _mm_unpacklo_epi16(channel[0], zero),
+        _mm_unpacklo_epi16(channel[1], zero)),
+      _mm_unpacklo_epi16(channel[2], zero));
+    const __m128i sum_high = _mm_add_epi32(
+      _mm_add_epi32(
+        _mm_unpackhi_epi16(channel[0], zero),
+        _mm_unpackhi_epi16(channel[1], zero)),
+      _mm_unpackhi_epi16(channel[2], zero));
+    _mm_storeu_si128(
+      reinterpret_cast<__m128i*>(grayscale+i),
+      _mm_packus_epi32(DivideBy3SSE41(sum_low), DivideBy3SSE41(sum_high)));
+  }
+  GrayscaleScalar(color+i*3, grayscale+i, count-i);
+}
+
+// (r+g)+b then a true division, as GrayscaleScalar rounds them.
+SIMD_TARGET_SSE41
+void GrayscaleSSE41(const float* color, float* grayscale, int32_t count) {
+  const __m128 three = _mm_set1_ps(3.0f);
+  int32_t i = 0;
+  for (; i+4<=count; i+=4) {
+    const __m128i* source = reinterpret_cast<const __m128i*>(color+i*3);
+    __m128i channel[3];
+    DeinterleaveSSE41(
+      _mm_loadu_si128(source+0), _mm_loadu_si128(source+1),
+      _mm_loadu_si128(source+2), kDeinterleaveRGB32, channel);
+    const __m128 sum = _mm_add_ps(
+      _mm_add_ps(_mm_castsi128_ps(channel[0]), _mm_castsi128_ps(channel[1])),
+      _mm_castsi128_ps(channel[2]));
+    _mm_storeu_ps(grayscale+i, _mm_div_ps(sum, three));
+  }
+  GrayscaleScalar(color+i*3, grayscale+i, count-i);
+}
+
+// The wider kernels split their pixels between the 128-bit lanes the way
+// GrayscaleAVX2 does, 48 bytes each.
+SIMD_TARGET_AVX2
+inline void DeinterleaveAVX2(
+    const void* color, const int8_t (*table)[16], __m256i* channel) {
+  const uint8_t* source = static_cast<const uint8_t*>(color);
+  const __m256i a = LoadLanesAVX2(source+0, source+48);
+  const __m256i b = LoadLanesAVX2(source+16, source+64);
+  const __m256i c = LoadLanesAVX2(source+32, source+80);
+  for (int32_t k=0; k<3; ++k) {
+    const __m128i* shuffle = reinterpret_cast<const __m128i*>(table[k*3]);
+    channel[k] = _mm256_or_si256(
+      _mm256_or_si256(
+        _mm256_shuffle_epi8(
+          a, _mm256_broadcastsi128_si256(_mm_load_si128(shuffle+0))),
+        _mm256_shuffle_epi8(
+          b, _mm256_broadcastsi128_si256(_mm_load_si128(shuffle+1)))),
+      _mm256_shuffle_epi8(
+        c, _mm256_broadcastsi128_si256(_mm_load_si128(shuffle+2))));
+  }
+}
+
+SIMD_TARGET_AVX2
+inline __m256i DivideBy3AVX2(__m256i sum) {
+  return _mm256_cvttps_epi32(
+    _mm256_div_ps(_mm256_cvtepi32_ps(sum), _mm256_set1_ps(3.0f)));
+}
+
+SIMD_TARGET_AVX2
+void GrayscaleAVX2(
+    const uint16_t* color, uint16_t* grayscale, int32_t count) {
+  const __m256i zero = _mm256_setzero_si256();
+  int32_t i = 0;
+  for (; i+16<=count; i+=16) {
+    __m256i channel[3];
+    DeinterleaveAVX2(color+i*3, kDeinterleaveRGB16, channel);
+    const __m256i sum_low = _mm256_add_epi32(
+      _mm256_add_epi32(
+        _mm256_unpacklo_epi16(channel[0], zero),
+        _mm256_unpacklo_epi16(channel[1], zero)),
+      _mm256_unpacklo_epi16(channel[2], zero));
+    const __m256i sum_high = _mm256_add_epi32(
+      _mm256_add_epi32(
+        _mm256_unpackhi_epi16(channel[0], zero),
+        _mm256_unpackhi_epi16(channel[1], zero)),
+      _mm256_unpackhi_epi16(channel[2], zero));
+    _mm256_storeu_si256(
+      reinterpret_cast<__m256i*>(grayscale+i),
+      _mm256_packus_epi32(DivideBy3AVX2(sum_low), DivideBy3AVX2(sum_high)));
+  }
+  GrayscaleSSE41(color+i*3, grayscale+i, count-i);
+}
+
+SIMD_TARGET_AVX2
+void GrayscaleAVX2(const float* color, float* grayscale, int32_t count) {
+  const __m256 three = _mm256_set1_ps(3.0f);
+  int32_t i = 0;
+  for (; i+8<=count; i+=8) {
+    __m256i channel[3];
+    DeinterleaveAVX2(color+i*3, kDeinterleaveRGB32, channel);
+    const __m256 sum = _mm256_add_ps(
+      _mm256_add_ps(
+        _mm256_castsi256_ps(channel[0]), _mm256_castsi256_ps(channel[1])),
+      _mm256_castsi256_ps(channel[2]));
+    _mm256_storeu_ps(grayscale+i, _mm256_div_ps(sum, three));
+  }
+  GrayscaleSSE41(color+i*3, grayscale+i, count-i);
+}
+#endif
+
+template <typename T>
+void GrayscaleRow(
+    SimdLevel level, const T* color, T* grayscale, int32_t count) {
+#if SIMD_X86
+  if (level == SimdLevel::kAVX2) {
+    GrayscaleAVX2(color, grayscale, count);
+    return;
+  }
+  if (level == SimdLevel::kSSE41) {
+    GrayscaleSSE41(color, grayscale, count);
+    return;
+  }
+#endif
+  GrayscaleScalar(color, grayscale, count);
+}
+
+// Converts the rows [y, y+rows) of image_pixels_, whose samples are of type
+// T, keeping their type. Grayscale inputs are only copied.
+template <typename T>
+void InputToGrayscale(
+    const Content& content, int32_t y, int32_t rows, T* grayscale) {
+  const size_t count = size_t(rows)*content.width;
+  const T* input = reinterpret_cast<const T*>(content.image_pixels_)+
+    size_t(y)*content.width*content.image_channels_;
+  if (content.image_channels_ == 1) {
+    std::copy(input, input+count, grayscale);
+  } else {
+    GrayscaleRow(
+      content.simd_level_, input, grayscale, static_cast<int32_t>(count));
+  }
+}
+
+// Samples of type T held in the bytes of an image of the staged chain.
+template <typename T>
+T* Samples(std::vector<uint8_t>& image) {
+  return reinterpret_cast<T*>(image.data());
+}
+
+// Both images are stored row after row without padding, so each band of
+// rows is converted as a single run of pixels. The grayscale image keeps
+// the type of the samples, like every image of the staged chain.
+void GrayscaleConversion(Content& content) {
+  ScopedTimer timer(content.profiler_, "GrayscaleConversion");
+  const int32_t width = content.width;
+  WithPixelType(content.image_pixel_type_, [&](auto sample) {
+    using T = decltype(sample);
+    content.image_data_grayscale_.resize(
+      size_t(width)*content.height*sizeof(T));
+    T* image_grayscale = Samples<T>(content.image_data_grayscale_);
+    content.thread_pool_.ParallelBands(
+      content.height, [&](int32_t, int32_t begin, int32_t end) {
+        InputToGrayscale(
+          content, begin, end-begin, image_grayscale+size_t(begin)*width);
+      });
+  });
+}
+
+using BoxKernel3 = StencilKernel<3,
+  1, 1, 1,
+  1, 1, 1,
+  1, 1, 1>;
+using SobelKernelX = StencilKernel<3,
+  1, 0, -1,
+  2, 0, -2,
+  1, 0, -1>;
+using SobelKernelY = StencilKernel<3,
+  1, 2, 1,
+  0, 0, 0,
+  -1, -2, -1>;
+
+// |Gx| and |Gy| reach 4*255, so the exact magnitude reaches 1443 and every
+// mode saturates it to 255. squared_threshold >= 0 outputs 255 where
+// Gx*Gx+Gy*Gy >= squared_threshold and 0 elsewhere instead.
+uint8_t SobelMagnitude(
+    MagnitudeMode mode, int32_t squared_threshold, int32_t Gx, int32_t Gy) {
+  const int32_t squared = Gx*Gx+Gy*Gy;
+  if (squared_threshold >= 0) {
+    return squared >= squared_threshold ? 255u : 0u;
+  }
+  int32_t magnitude;
+  if (mode == MagnitudeMode::kL1) {
+    magnitude = std::abs(Gx)+std::abs(Gy);
+  } else if (mode == MagnitudeMode::kL2) {
+    // Same approximation and Newton step as the vector code.
+    const float m = static_cast<float>(std::max(squared, 1));
+#if SIMD_X86
+    float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(m)));
+#else
+    float r = 1.0f/std::sqrt(m);
+#endif
+    r = r*(1.5f-0.5f*m*r*r);
+    magnitude = squared == 0 ? 0 : static_cast<int32_t>(m*r);
+  } else {
+    // floor(sqrt(squared)) >= t exactly when squared >= t*t, so thresholding
+    // the result is the same as comparing the squares.
+    magnitude = static_cast<int32_t>(
+      std::sqrt(static_cast<float>(std::min(squared, 65535))));
+  }
+  return static_cast<uint8_t>(std::min(magnitude, 255));
+}
+
+// Rounds down for the integer types.
+template <typename T>
+struct BlurOp {
+  template <typename Tap>
+  T operator()(const Tap& tap) const {
+    return static_cast<T>(BoxKernel3::Apply(tap)/9);
+  }
+};
+
+struct SobelOp {
+  MagnitudeMode mode;
+  int32_t squared_threshold;  // See SobelMagnitude
+
+  template <typename Tap>
+  uint8_t operator()(const Tap& tap) const {
+    return SobelMagnitude(
+      mode, squared_threshold, SobelKernelX::Apply(tap),
+      SobelKernelY::Apply(tap));
+  }
+};
+
+// Sobel magnitude of samples wider than 8 bits, in their own type: the
+// 16-bit magnitudes saturate to 65535 as the 8-bit ones do to 255, the
+// float ones are kept whole. kL2 is the exact magnitude, as in EdgeOp, so
+// thresholding them gives the mask of the fused pass.
+template <typename T>
+struct MagnitudeOp {
+  using Sum = typename PixelTraits<T>::Sum;
+  using Square = typename PixelTraits<T>::Square;
+  bool l1;
+
+  template <typename Tap>
+  T operator()(const Tap& tap) const {
+    const Sum Gx = SobelKernelX::Apply(tap);
+    const Sum Gy = SobelKernelY::Apply(tap);
+    if constexpr (std::is_floating_point<T>::value) {
+      return l1 ? std::abs(Gx)+std::abs(Gy) : std::sqrt(Gx*Gx+Gy*Gy);
+    } else {
+      // The squares reach 2^37, whose square roots doubles round well below
+      // the next integer, so the truncation is the integer square root.
+      const double magnitude = l1 ?
+        static_cast<double>(std::abs(Gx)+std::abs(Gy)) :
+        std::sqrt(static_cast<double>(Square(Gx)*Gx+Square(Gy)*Gy));
+      return static_cast<T>(
+        std::min(magnitude, double(std::numeric_limits<T>::max())));
+    }
+  }
+};
+
+#if SIMD_X86
+// 16-bit Sobel of 16 pixels starting at x: Gx and Gy fit in 16 bits, and
+// the squares are summed in 32 bits by madd.
+SIMD_TARGET_SSE41
+inline __m128i LoadWidenSSE41(const uint8_t* row, int32_t half) {
+  return _mm_cvtepu8_epi16(
+    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row+half*8)));
+}
+
+SIMD_TARGET_SSE41
+void SobelGradientsSSE41(
+    const uint8_t* const* rows, int32_t x, __m128i* Gx, __m128i* Gy) {
+  for (int32_t half=0; half<2; ++half) {
+    const __m128i tl = LoadWidenSSE41(rows[0]+x-1, half);
+    const __m128i tc = LoadWidenSSE41(rows[0]+x, half);
+    const __m128i tr = LoadWidenSSE41(rows[0]+x+1, half);
+    const __m128i ml = LoadWidenSSE41(rows[1]+x-1, half);
+    const __m128i mr = LoadWidenSSE41(rows[1]+x+1, half);
+    const __m128i bl = LoadWidenSSE41(rows[2]+x-1, half);
+    const __m128i bc = LoadWidenSSE41(rows[2]+x, half);
+    const __m128i br = LoadWidenSSE41(rows[2]+x+1, half);
+    Gx[half] = _mm_sub_epi16(
+      _mm_add_epi16(_mm_add_epi16(tl, bl), _mm_slli_epi16(ml, 1)),
+      _mm_add_epi16(_mm_add_epi16(tr, br), _mm_slli_epi16(mr, 1)));
+    Gy[half] = _mm_sub_epi16(
+      _mm_add_epi16(_mm_add_epi16(tl, tr), _mm_slli_epi16(tc, 1)),
+      _mm_add_epi16(_mm_add_epi16(bl, br), _mm_slli_epi16(bc, 1)));
+  }
+}
+
+// 4 magnitudes from 4 sums of squares, as SobelMagnitude.
+SIMD_TARGET_SSE41
+__m128i SquaredToMagnitudeSSE41(
+    MagnitudeMode mode, int32_t squared_threshold, __m128i squared) {
+  if (squared_threshold >= 0) {
+    return _mm_cmpgt_epi32(squared, _mm_set1_epi32(squared_threshold-1));
+  }
+  if (mode == MagnitudeMode::kL2) {
+    const __m128 m = _mm_cvtepi32_ps(_mm_max_epi32(squared, _mm_set1_epi32(1)));
+    __m128 r = _mm_rsqrt_ps(m);
+    r = _mm_mul_ps(r, _mm_sub_ps(
+      _mm_set1_ps(1.5f),
+      _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), m), r), r)));
+    const __m128i magnitude = _mm_cvttps_epi32(_mm_mul_ps(m, r));
+    return _mm_andnot_si128(
+      _mm_cmpeq_epi32(squared, _mm_setzero_si128()), magnitude);
+  }
+  return _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(
+    _mm_min_epi32(squared, _mm_set1_epi32(65535)))));
+}
+
+// Interior pixels of a Sobel row, 16 at a time. Returns the first x left.
+SIMD_TARGET_SSE41
+int32_t SobelRowSSE41(
+    const uint8_t* const* rows, int32_t width, uint8_t* output,
+    MagnitudeMode mode, int32_t squared_threshold) {
+  int32_t x = 1;
+  for (; x+16<=width-1; x+=16) {
+    __m128i Gx[2];
+    __m128i Gy[2];
+    SobelGradientsSSE41(rows, x, Gx, Gy);
+    __m128i magnitude[2];
+    for (int32_t half=0; half<2; ++half) {
+      if (mode == MagnitudeMode::kL1 && squared_threshold < 0) {
+        magnitude[half] = _mm_add_epi16(
+          _mm_abs_epi16(Gx[half]), _mm_abs_epi16(Gy[half]));
+        continue;
+      }
+      const __m128i low = _mm_unpacklo_epi16(Gx[half], Gy[half]);
+      const __m128i high = _mm_unpackhi_epi16(Gx[half], Gy[half]);
+      magnitude[half] = _mm_packs_epi32(
+        SquaredToMagnitudeSSE41(
+          mode, squared_threshold, _mm_madd_epi16(low, low)),
+        SquaredToMagnitudeSSE41(
+          mode, squared_threshold, _mm_madd_epi16(high, high)));
+    }
+    // The compare masks are -1, which packs_epi16 keeps as 0xFF.
+    const __m128i packed = squared_threshold >= 0 ?
+      _mm_packs_epi16(magnitude[0], magnitude[1]) :
+      _mm_packus_epi16(magnitude[0], magnitude[1]);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output+x), packed);
+  }
+  return x;
+}
+
+SIMD_TARGET_AVX2
+inline __m256i LoadWidenAVX2(const uint8_t* row, int32_t half) {
+  return _mm256_cvtepu8_epi16(
+    _mm_loadu_si128(reinterpret_cast<const __m128i*>(row+half*16)));
+}
+
+SIMD_TARGET_AVX2
+void SobelGradientsAVX2(
+    const uint8_t* const* rows, int32_t x, __m256i* Gx, __m256i* Gy) {
+  for (int32_t half=0; half<2; ++half) {
+    const __m256i tl = LoadWidenAVX2(rows[0]+x-1, half);
+    const __m256i tc = LoadWidenAVX2(rows[0]+x, half);
+    const __m256i tr = LoadWidenAVX2(rows[0]+x+1, half);
+    const __m256i ml = LoadWidenAVX2(rows[1]+x-1, half);
+    const __m256i mr = LoadWidenAVX2(rows[1]+x+1, half);
+    const __m256i bl = LoadWidenAVX2(rows[2]+x-1, half);
+    const __m256i bc = LoadWidenAVX2(rows[2]+x, half);
+    const __m256i br = LoadWidenAVX2(rows[2]+x+1, half);
+    Gx[half] = _mm256_sub_epi16(
+      _mm256_add_epi16(_mm256_add_epi16(tl, bl), _mm256_slli_epi16(ml, 1)),
+      _mm256_add_epi16(_mm256_add_epi16(tr, br), _mm256_slli_epi16(mr, 1)));
+    Gy[half] = _mm256_sub_epi16(
+      _mm256_add_epi16(_mm256_add_epi16(tl, tr), _mm256_slli_epi16(tc, 1)),
+      _mm256_add_epi16(_mm256_add_epi16(bl, br), _mm256_slli_epi16(bc, 1)));
+  }
+}
+
+SIMD_TARGET_AVX2
+__m256i SquaredToMagnitudeAVX2(
+    MagnitudeMode mode, int32_t squared_threshold, __m256i squared) {
+  if (squared_threshold >= 0) {
+    return _mm256_cmpgt_epi32(squared, _mm256_set1_epi32(squared_threshold-1));
+  }
+  if (mode == MagnitudeMode::kL2) {
+    const __m256 m = _mm256_cvtepi32_ps(
+      _mm256_max_epi32(squared, _mm256_set1_epi32(1)));
+    __m256 r = _mm256_rsqrt_ps(m);
+    r = _mm256_mul_ps(r, _mm256_sub_ps(
+      _mm256_set1_ps(1.5f),
+      _mm256_mul_ps(
+        _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), m), r), r)));
+    const __m256i magnitude = _mm256_cvttps_epi32(_mm256_mul_ps(m, r));
+    return _mm256_andnot_si256(
+      _mm256_cmpeq_epi32(squared, _mm256_setzero_si256()), magnitude);
+  }
+  return _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(
+    _mm256_min_epi32(squared, _mm256_set1_epi32(65535)))));
+}
+
+// Interior pixels of a Sobel row, 32 at a time. Returns the first x left.
+SIMD_TARGET_AVX2
+int32_t SobelRowAVX2(
+    const uint8_t* const* rows, int32_t width, uint8_t* output,
+    MagnitudeMode mode, int32_t squared_threshold) {
+  int32_t x = 1;
+  for (; x+32<=width-1; x+=32) {
+    __m256i Gx[2];
+    __m256i Gy[2];
+    SobelGradientsAVX2(rows, x, Gx, Gy);
+    __m256i magnitude[2];
+    for (int32_t half=0; half<2; ++half) {
+      if (mode == MagnitudeMode::kL1 && squared_threshold < 0) {
+        magnitude[half] = _mm256_add_epi16(
+          _mm256_abs_epi16(Gx[half]), _mm256_abs_epi16(Gy[half]));
+        continue;
+      }
+      // unpack and packs both work within 128-bit lanes, so the pixels
+      // come back in order.
+      const __m256i low = _mm256_unpacklo_epi16(Gx[half], Gy[half]);
+      const __m256i high = _mm256_unpackhi_epi16(Gx[half], Gy[half]);
+      magnitude[half] = _mm256_packs_epi32(
+        SquaredToMagnitudeAVX2(
+          mode, squared_threshold, _mm256_madd_epi16(low, low)),
+        SquaredToMagnitudeAVX2(
+          mode, squared_threshold, _mm256_madd_epi16(high, high)));
+    }
+    const __m256i packed = squared_threshold >= 0 ?
+      _mm256_packs_epi16(magnitude[0], magnitude[1]) :
+      _mm256_packus_epi16(magnitude[0], magnitude[1]);
+    // Packing interleaves the 128-bit lanes of both halves.
+    _mm256_storeu_si256(
+      reinterpret_cast<__m256i*>(output+x),
+      _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  return x;
+}
+#endif
+
+// Sobel magnitudes of a row, the interior with 16-bit vectors and the
+// remaining pixels with SobelOp.
+template <typename Border>
+void SobelRow(
+    SimdLevel level, const uint8_t* const* rows, int32_t width,
+    uint8_t* output, const SobelOp& op) {
+  StencilBorderColumns<1, Border>(rows, width, output, op);
+  int32_t x = 1;
+#if SIMD_X86
+  if (level == SimdLevel::kAVX2) {
+    x = SobelRowAVX2(rows, width, output, op.mode, op.squared_threshold);
+  } else if (level == SimdLevel::kSSE41) {
+    x = SobelRowSSE41(rows, width, output, op.mode, op.squared_threshold);
+  }
+#endif
+  StencilInterior<1>(rows, x, width-1, output, op);
+}
+
+// Edge test of the fused pass on samples wider than 8 bits: 255 where the
+// gradient reaches the threshold scaled to the samples, 0 elsewhere. Without
+// the 8-bit saturation to reproduce, kL2 compares the exact squares as
+// kSquared does, so only kL1 differs.
+template <typename T>
+struct EdgeOp {
+  using Sum = typename PixelTraits<T>::Sum;
+  using Square = typename PixelTraits<T>::Square;
+  bool l1;
+  Sum threshold;
+  Square squared_threshold;
+
+  EdgeOp(MagnitudeMode mode, uint8_t level)
+      : l1(mode == MagnitudeMode::kL1),
+        threshold(static_cast<Sum>(level*PixelTraits<T>::kScale)),
+        squared_threshold(Square(threshold)*threshold) {}
+
+  template <typename Tap>
+  uint8_t operator()(const Tap& tap) const {
+    const Sum Gx = SobelKernelX::Apply(tap);
+    const Sum Gy = SobelKernelY::Apply(tap);
+    if (l1) {
+      return std::abs(Gx)+std::abs(Gy) >= threshold ? 255u : 0u;
+    }
+    return Square(Gx)*Gx+Square(Gy)*Gy >= squared_threshold ? 255u : 0u;
+  }
+};
+
+#if SIMD_X86
+// The SIMD edge tests compute the gradients in 32-bit lanes. The 16-bit
+// squares reach 2^37, so they are summed in doubles, which hold them
+// exactly. The float kernels add the taps in the order of StencilKernel, so
+// every rounding matches EdgeOp. Both return the first x left.
+SIMD_TARGET_SSE41
+inline __m128i LoadSamplesSSE41(const uint16_t* row) {
+  return _mm_cvtepu16_epi32(
+    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row)));
+}
+
+SIMD_TARGET_SSE41
+inline void StoreEdgesSSE41(__m128i edges, uint8_t* output) {
+  const __m128i words = _mm_packs_epi32(edges, edges);
+  const int32_t bytes = _mm_cvtsi128_si32(_mm_packs_epi16(words, words));
+  std::memcpy(output, &bytes, sizeof(bytes));
+}
+
+SIMD_TARGET_SSE41
+int32_t EdgeRowSSE41(
+    const uint16_t* const* rows, int32_t width, uint8_t* output,
+    const EdgeOp<uint16_t>& op) {
+  const __m128i threshold = _mm_set1_epi32(op.threshold);
+  const __m128d squared_threshold =
+    _mm_set1_pd(static_cast<double>(op.squared_threshold));
+  int32_t x = 1;
+  for (; x+4<=width-1; x+=4) {
+    const __m128i tl = LoadSamplesSSE41(rows[0]+x-1);
+    const __m128i tc = LoadSamplesSSE41(rows[0]+x);
+    const __m128i tr = LoadSamplesSSE41(rows[0]+x+1);
+    const __m128i ml = LoadSamplesSSE41(rows[1]+x-1);
+    const __m128i mr = LoadSamplesSSE41(rows[1]+x+1);
+    const __m128i bl = LoadSamplesSSE41(rows[2]+x-1);
+    const __m128i bc = LoadSamplesSSE41(rows[2]+x);
+    const __m128i br = LoadSamplesSSE41(rows[2]+x+1);
+    const __m128i Gx = _mm_sub_epi32(
+      _mm_add_epi32(_mm_add_epi32(tl, bl), _mm_slli_epi32(ml, 1)),
+      _mm_add_epi32(_mm_add_epi32(tr, br), _mm_slli_epi32(mr, 1)));
+    const __m128i Gy = _mm_sub_epi32(
+      _mm_add_epi32(_mm_add_epi32(tl, tr), _mm_slli_epi32(tc, 1)),
+      _mm_add_epi32(_mm_add_epi32(bl, br), _mm_slli_epi32(bc, 1)));
+    __m128i edges;
+    if (op.l1) {
+      edges = _mm_xor_si128(
+        _mm_cmpgt_epi32(
+          threshold, _mm_add_epi32(_mm_abs_epi32(Gx), _mm_abs_epi32(Gy))),
+        _mm_set1_epi32(-1));
+    } else {
+      __m128d squared_ge[2];
+      for (int32_t half=0; half<2; ++half) {
+        const __m128d gx = _mm_cvtepi32_pd(
+          half ? _mm_unpackhi_epi64(Gx, Gx) : Gx);
+        const __m128d gy = _mm_cvtepi32_pd(
+          half ? _mm_unpackhi_epi64(Gy, Gy) : Gy);
+        squared_ge[half] = _mm_cmpge_pd(
+          _mm_add_pd(_mm_mul_pd(gx, gx), _mm_mul_pd(gy, gy)),
+          squared_threshold);
+      }
+      edges = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castpd_ps(squared_ge[0]), _mm_castpd_ps(squared_ge[1]),
+        _MM_SHUFFLE(2, 0, 2, 0)));
+    }
+    StoreEdgesSSE41(edges, output+x);
+  }
+  return x;
+}
+
+SIMD_TARGET_SSE41
+int32_t EdgeRowSSE41(
+    const float* const* rows, int32_t width, uint8_t* output,
+    const EdgeOp<float>& op) {
+  const __m128 threshold = _mm_set1_ps(op.threshold);
+  const __m128 squared_threshold = _mm_set1_ps(op.squared_threshold);
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  int32_t x = 1;
+  for (; x+4<=width-1; x+=4) {
+    const __m128 tl = _mm_loadu_ps(rows[0]+x-1);
+    const __m128 tc = _mm_loadu_ps(rows[0]+x);
+    const __m128 tr = _mm_loadu_ps(rows[0]+x+1);
+    const __m128 ml = _mm_loadu_ps(rows[1]+x-1);
+    const __m128 mr = _mm_loadu_ps(rows[1]+x+1);
+    const __m128 bl = _mm_loadu_ps(rows[2]+x-1);
+    const __m128 bc = _mm_loadu_ps(rows[2]+x);
+    const __m128 br = _mm_loadu_ps(rows[2]+x+1);
+    const __m128 Gx = _mm_sub_ps(_mm_add_ps(_mm_sub_ps(_mm_add_ps(
+      _mm_sub_ps(tl, tr), _mm_add_ps(ml, ml)), _mm_add_ps(mr, mr)), bl), br);
+    const __m128 Gy = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(_mm_add_ps(
+      _mm_add_ps(tl, _mm_add_ps(tc, tc)), tr), bl), _mm_add_ps(bc, bc)), br);
+    const __m128 edges = op.l1 ?
+      _mm_cmpge_ps(
+        _mm_add_ps(_mm_andnot_ps(sign, Gx), _mm_andnot_ps(sign, Gy)),
+        threshold) :
+      _mm_cmpge_ps(
+        _mm_add_ps(_mm_mul_ps(Gx, Gx), _mm_mul_ps(Gy, Gy)),
+        squared_threshold);
+    StoreEdgesSSE41(_mm_castps_si128(edges), output+x);
+  }
+  return x;
+}
+
+SIMD_TARGET_AVX2
+inline __m256i LoadSamplesAVX2(const uint16_t* row) {
+  return _mm256_cvtepu16_epi32(
+    _mm_loadu_si128(reinterpret_cast<const __m128i*>(row)));
+}
+
+SIMD_TARGET_AVX2
+inline void StoreEdgesAVX2(__m256i edges, uint8_t* output) {
+  const __m128i words = _mm_packs_epi32(
+    _mm256_castsi256_si128(edges), _mm256_extracti128_si256(edges, 1));
+  _mm_storel_epi64(
+    reinterpret_cast<__m128i*>(output), _mm_packs_epi16(words, words));
+}
+
+SIMD_TARGET_AVX2
+int32_t EdgeRowAVX2(
+    const uint16_t* const* rows, int32_t width, uint8_t* output,
+    const EdgeOp<uint16_t>& op) {
+  const __m256i threshold = _mm256_set1_epi32(op.threshold);
+  const __m256d squared_threshold =
+    _mm256_set1_pd(static_cast<double>(op.squared_threshold));
+  // Gathers the low 32 bits of the 4 compare masks of each half.
+  const __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  int32_t x = 1;
+  for (; x+8<=width-1; x+=8) {
+    const __m256i tl = LoadSamplesAVX2(rows[0]+x-1);
+    const __m256i tc = LoadSamplesAVX2(rows[0]+x);
+    const __m256i tr = LoadSamplesAVX2(rows[0]+x+1);
+    const __m256i ml = LoadSamplesAVX2(rows[1]+x-1);
+    const __m256i mr = LoadSamplesAVX2(rows[1]+x+1);
+    const __m256i bl = LoadSamplesAVX2(rows[2]+x-1);
+    const __m256i bc = LoadSamplesAVX2(rows[2]+x);
+    const __m256i br = LoadSamplesAVX2(rows[2]+x+1);
+    const __m256i Gx = _mm256_sub_epi32(
+      _mm256_add_epi32(_mm256_add_epi32(tl, bl), _mm256_slli_epi32(ml, 1)),
+      _mm256_add_epi32(_mm256_add_epi32(tr, br), _mm256_slli_epi32(mr, 1)));
+    const __m256i Gy = _mm256_sub_epi32(
+      _mm256_add_epi32(_mm256_add_epi32(tl, tr), _mm256_slli_epi32(tc, 1)),
+      _mm256_add_epi32(_mm256_add_epi32(bl, br), _mm256_slli_epi32(bc, 1)));
+    __m256i edges;
+    if (op.l1) {
+      edges = _mm256_xor_si256(
+        _mm256_cmpgt_epi32(
+          threshold,
+          _mm256_add_epi32(_mm256_abs_epi32(Gx), _mm256_abs_epi32(Gy))),
+        _mm256_set1_epi32(-1));
+    } else {
+      __m256i squared_ge[2];
+      for (int32_t half=0; half<2; ++half) {
+        const __m256d gx = _mm256_cvtepi32_pd(half ?
+          _mm256_extracti128_si256(Gx, 1) : _mm256_castsi256_si128(Gx));
+        const __m256d gy = _mm256_cvtepi32_pd(half ?
+          _mm256_extracti128_si256(Gy, 1) : _mm256_castsi256_si128(Gy));
+        squared_ge[half] = _mm256_permutevar8x32_epi32(
+          _mm256_castpd_si256(_mm256_cmp_pd(
+            _mm256_add_pd(_mm256_mul_pd(gx, gx), _mm256_mul_pd(gy, gy)),
+            squared_threshold, _CMP_GE_OQ)),
+          low_halves);
+      }
+      edges = _mm256_blend_epi32(squared_ge[0], squared_ge[1], 0xF0);
+    }
+    StoreEdgesAVX2(edges, output+x);
+  }
+  return x;
+}
+
+SIMD_TARGET_AVX2
+int32_t EdgeRowAVX2(
+    const float* const* rows, int32_t width, uint8_t* output,
+    const EdgeOp<float>& op) {
+  const __m256 threshold = _mm256_set1_ps(op.threshold);
+  const __m256 squared_threshold = _mm256_set1_ps(op.squared_threshold);
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  int32_t x = 1;
+  for (; x+8<=width-1; x+=8) {
+    const __m256 tl = _mm256_loadu_ps(rows[0]+x-1);
+    const __m256 tc = _mm256_loadu_ps(rows[0]+x);
+    const __m256 tr = _mm256_loadu_ps(rows[0]+x+1);
+    const __m256 ml = _mm256_loadu_ps(rows[1]+x-1);
+    const __m256 mr = _mm256_loadu_ps(rows[1]+x+1);
+    const __m256 bl = _mm256_loadu_ps(rows[2]+x-1);
+    const __m256 bc = _mm256_loadu_ps(rows[2]+x);
+    const __m256 br = _mm256_loadu_ps(rows[2]+x+1);
+    const __m256 Gx = _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_add_ps(
+      _mm256_sub_ps(tl, tr), _mm256_add_ps(ml, ml)), _mm256_add_ps(mr, mr)),
+      bl), br);
+    const __m256 Gy = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(
+      _mm256_add_ps(tl, _mm256_add_ps(tc, tc)), tr), bl),
+      _mm256_add_ps(bc, bc)), br);
+    const __m256 edges = op.l1 ?
+      _mm256_cmp_ps(
+        _mm256_add_ps(_mm256_andnot_ps(sign, Gx), _mm256_andnot_ps(sign, Gy)),
+        threshold, _CMP_GE_OQ) :
+      _mm256_cmp_ps(
+        _mm256_add_ps(_mm256_mul_ps(Gx, Gx), _mm256_mul_ps(Gy, Gy)),
+        squared_threshold, _CMP_GE_OQ);
+    StoreEdgesAVX2(_mm256_castps_si256(edges), output+x);
+  }
+  return x;
+}
+#endif
+
+// Edge bytes of a row of samples wider than 8 bits, for PackEdgeRow.
+template <typename Border, typename T>
+void EdgeRow(
+    SimdLevel level, const T* const* rows, int32_t width, uint8_t* output,
+    const EdgeOp<T>& op) {
+  StencilBorderColumns<1, Border>(rows, width, output, op);
+  int32_t x = 1;
+#if SIMD_X86
+  if (level == SimdLevel::kAVX2) {
+    x = EdgeRowAVX2(rows, width, output, op);
+  } else if (level == SimdLevel::kSSE41) {
+    x = EdgeRowSSE41(rows, width, output, op);
+  }
+#endif
+  StencilInterior<1>(rows, x, width-1, output, op);
+}
+
+// Runs row(border, rows, output) on every row of image_data_grayscale_ into
+// image_scratch_, rows being the 3 input rows around it resolved through
+// border_policy_, then swaps both images. Both hold samples of type T.
+template <typename T, typename RowOp>
+void Stencil3x3(Content& content, const RowOp& row) {
+  const int32_t width = content.width;
+  const int32_t height = content.height;
+  std::vector<uint8_t>& image_input = content.image_data_grayscale_;
+  std::vector<uint8_t>& image_output = content.image_scratch_;
+  image_output.resize(size_t(width)*height*sizeof(T));
+  const T* input = Samples<T>(image_input);
+  T* output = Samples<T>(image_output);
+  T* zero_row = content.frame_arena_.Allocate<T>(width);
+  std::fill(zero_row, zero_row+width, T(0));
+  WithBorder(content.border_policy_, [&](auto border) {
+    using Border = decltype(border);
+    content.thread_pool_.ParallelBands(
+      height, [&](int32_t, int32_t begin, int32_t end) {
+        for (int32_t y=begin; y<end; ++y) {
+          const T* rows[3];
+          for (int32_t dy=-1; dy<=1; ++dy) {
+            rows[dy+1] = BorderRow<Border>(
+              input, width, height, y+dy, zero_row);
+          }
+          row(border, rows, output+size_t(y)*width);
+        }
+      });
+  });
+  std::swap(image_input, image_output);
+}
+
+// Box blur of radius blur_radius_. Radius 1 is the 3x3 stencil, larger radii
+// use running sums: each row is summed horizontally with a sliding window
+// and those row sums slide vertically in one running sum per column, so the
+// cost per pixel does not depend on the radius. Every band primes its column
+// sums from the radius rows above it. Both read outside the image through
+// border_policy_, so every pixel is blurred.
+template <typename T>
+void BlurImage(Content& content, int32_t radius) {
+  const int32_t width = content.width;
+  const int32_t height = content.height;
+  if (radius == 1) {
+    Stencil3x3<T>(
+      content, [&](auto border, const T* const* rows, T* output) {
+        StencilRow<1, decltype(border)>(rows, width, output, BlurOp<T>());
+      });
+    return;
+  }
+  using BoxSum = typename PixelTraits<T>::BoxSum;
+  const int32_t size = 2*radius+1;
+  std::vector<uint8_t>& image_grayscale = content.image_data_grayscale_;
+  std::vector<uint8_t>& image_blurred = content.image_scratch_;
+  image_blurred.resize(size_t(width)*height*sizeof(T));
+  const T* grayscale = Samples<T>(image_grayscale);
+  T* blurred_image = Samples<T>(image_blurred);
+
+  // Exact division of 8-bit sums, below 2^28, by the box area: with
+  // 2^(l-1) < area <= 2^l, sum/area == (sum*reciprocal)>>(28+l)
+  // (Granlund-Montgomery). The wider sums are divided as they are.
+  const uint32_t area = size*size;
+  int32_t shift = 28;
+  while ((1u<<(shift-28)) < area) {
+    ++shift;
+  }
+  const uint64_t reciprocal = (uint64_t(1)<<shift)/area+1;
+
+  const size_t sums_size = content.thread_pool_.thread_count()*3*width;
+  BoxSum* blur_sums = content.frame_arena_.Allocate<BoxSum>(sums_size);
+  WithBorder(content.border_policy_, [&](auto border) {
+    using Border = decltype(border);
+    // Horizontal window sums of row y, 0 for the rows reading as 0.
+    auto sum_row = [&](int32_t y, BoxSum* sums) {
+      const int32_t index = Border::Index(y, height);
+      if (index < 0) {
+        std::fill(sums, sums+width, BoxSum(0));
+        return;
+      }
+      const T* row = grayscale+size_t(index)*width;
+      auto tap = [&](int32_t x) -> BoxSum {
+        if (x >= 0 && x < width) {
+          return row[x];
+        }
+        const int32_t column = Border::Index(x, width);
+        return column < 0 ? BoxSum(0) : BoxSum(row[column]);
+      };
+      BoxSum sum = 0;
+      for (int32_t x=-radius; x<=radius; ++x) {
+        sum += tap(x);
+      }
+      sums[0] = sum;
+      const int32_t interior_begin = std::min(radius+1, width);
+      const int32_t interior_end = std::max(width-radius, interior_begin);
+      for (int32_t x=1; x<interior_begin; ++x) {
+        sum += tap(x+radius);
+        sum -= tap(x-radius-1);
+        sums[x] = sum;
+      }
+      for (int32_t x=interior_begin; x<interior_end; ++x) {
+        sum += row[x+radius];
+        sum -= row[x-radius-1];
+        sums[x] = sum;
+      }
+      for (int32_t x=interior_end; x<width; ++x) {
+        sum += tap(x+radius);
+        sum -= tap(x-radius-1);
+        sums[x] = sum;
+      }
+    };
+
+    content.thread_pool_.ParallelBands(
+      height, [&](int32_t band, int32_t begin, int32_t end) {
+        BoxSum* column_sum = blur_sums+band*3*width;
+        BoxSum* entering = column_sum+width;
+        BoxSum* leaving = column_sum+2*width;
+        std::fill(column_sum, column_sum+width, BoxSum(0));
+        for (int32_t y=begin-radius; y<=begin+radius; ++y) {
+          sum_row(y, entering);
+          for (int32_t x=0; x<width; ++x) {
+            column_sum[x] += entering[x];
+          }
+        }
+        for (int32_t y=begin; y<end; ++y) {
+          if (y > begin) {
+            sum_row(y+radius, entering);
+            sum_row(y-radius-1, leaving);
+            for (int32_t x=0; x<width; ++x) {
+              column_sum[x] += entering[x]-leaving[x];
+            }
+          }
+          T* blurred = blurred_image+size_t(y)*width;
+          for (int32_t x=0; x<width; ++x) {
+            if constexpr (std::is_same<T, uint8_t>::value) {
+              blurred[x] =
+                static_cast<uint8_t>((column_sum[x]*reciprocal)>>shift);
+            } else {
+              blurred[x] = static_cast<T>(column_sum[x]/area);
+            }
+          }
+        }
+      });
+  });
+  std::swap(image_grayscale, image_blurred);
+}
+
+void BlurImage(Content& content) {
+  ScopedTimer timer(content.profiler_, "BlurImage");
+  const int32_t radius = std::min(content.blur_radius_, kMaxBlurRadius);
+  if (radius <= 0) {
+    return;
+  }
+  WithPixelType(content.image_pixel_type_, [&](auto sample) {
+    BlurImage<decltype(sample)>(content, radius);
+  });
+}
+
+// Sobel magnitude of every pixel following magnitude_mode_, the borders
+// following border_policy_.
+void ContourDetection(Content& content) {
+  ScopedTimer timer(content.profiler_, "ContourDetection");
+  WithPixelType(content.image_pixel_type_, [&](auto sample) {
+    using T = decltype(sample);
+    if constexpr (std::is_same<T, uint8_t>::value) {
+      const SobelOp op = {content.magnitude_mode_, -1};
+      Stencil3x3<T>(
+        content, [&](auto border, const T* const* rows, T* output) {
+          SobelRow<decltype(border)>(
+            content.simd_level_, rows, content.width, output, op);
+        });
+    } else {
+      const MagnitudeOp<T> op = {
+        content.magnitude_mode_ == MagnitudeMode::kL1};
+      Stencil3x3<T>(
+        content, [&](auto border, const T* const* rows, T* output) {
+          StencilRow<1, decltype(border)>(rows, content.width, output, op);
+        });
+    }
+  });
+}
+
+// Sets bit x of the row words when values[x] >= threshold. The bits after
+// width are set as well.
+template <typename T>
+void PackEdgeRowScalar(
+    const T* values, int32_t width, T threshold, uint64_t* words,
+    int32_t first_word = 0) {
+  const int32_t word_count = (width+63)/64;
+  for (int32_t word=first_word; word<word_count; ++word) {
+    uint64_t bits = 0;
+    for (int32_t bit=0; bit<64; ++bit) {
+      const int32_t x = word*64+bit;
+      if (x >= width || values[x] >= threshold) {
+        bits |= uint64_t(1)<<bit;
+      }
+    }
+    words[word] = bits;
+  }
+}
+
+#if SIMD_X86
+// values >= threshold is max(values, threshold) == values for unsigned bytes.
+SIMD_TARGET_SSE41
+void PackEdgeRowSSE41(
+    const uint8_t* values, int32_t width, uint8_t threshold, uint64_t* words) {
+  const __m128i level = _mm_set1_epi8(static_cast<char>(threshold));
+  int32_t word = 0;
+  for (; word*64+64<=width; ++word) {
+    uint64_t bits = 0;
+    for (int32_t k=0; k<4; ++k) {
+      const __m128i v = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(values+word*64+k*16));
+      const uint32_t edges = static_cast<uint16_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, level), v)));
+      bits |= uint64_t(edges)<<(k*16);
+    }
+    words[word] = bits;
+  }
+  PackEdgeRowScalar(values, width, threshold, words, word);
+}
+
+SIMD_TARGET_AVX2
+void PackEdgeRowAVX2(
+    const uint8_t* values, int32_t width, uint8_t threshold, uint64_t* words) {
+  const __m256i level = _mm256_set1_epi8(static_cast<char>(threshold));
+  int32_t word = 0;
+  for (; word*64+64<=width; ++word) {
+    const __m256i low = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(values+word*64));
+    const __m256i high = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(values+word*64+32));
+    const uint32_t low_edges = static_cast<uint32_t>(_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_max_epu8(low, level), low)));
+    const uint32_t high_edges = static_cast<uint32_t>(_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_max_epu8(high, level), high)));
+    words[word] = uint64_t(low_edges)|(uint64_t(high_edges)<<32);
+  }
+  PackEdgeRowScalar(values, width, threshold, words, word);
+}
+#endif
+
+void PackEdgeRow(
+    SimdLevel level, const uint8_t* values, int32_t width, uint8_t threshold,
+    uint64_t* words) {
+#if SIMD_X86
+  if (level == SimdLevel::kAVX2) {
+    PackEdgeRowAVX2(values, width, threshold, words);
+    return;
+  }
+  if (level == SimdLevel::kSSE41) {
+    PackEdgeRowSSE41(values, width, threshold, words);
+    return;
+  }
+#endif
+  PackEdgeRowScalar(values, width, threshold, words);
+}
+
+// Thresholds the contour magnitudes of image_data_grayscale_ into the bit
+// packed edge_mask_, level_threshold_ being scaled to the samples as in the
+// fused pass.
+void ApplyLevel(Content& content) {
+  ScopedTimer timer(content.profiler_, "ApplyLevel");
+  const int32_t width = content.width;
+  EdgeMask& mask = content.edge_mask_;
+  mask.Resize(width, content.height);
+  WithPixelType(content.image_pixel_type_, [&](auto sample) {
+    using T = decltype(sample);
+    const T* image_grayscale = Samples<T>(content.image_data_grayscale_);
+    const T threshold = static_cast<T>(
+      content.level_threshold_*PixelTraits<T>::kScale);
+    content.thread_pool_.ParallelBands(
+      content.height, [&](int32_t, int32_t begin, int32_t end) {
+        for (int32_t y=begin; y<end; ++y) {
+          const T* values = image_grayscale+size_t(y)*width;
+          if constexpr (std::is_same<T, uint8_t>::value) {
+            PackEdgeRow(
+              content.simd_level_, values, width, threshold, mask.Row(y));
+          } else {
+            PackEdgeRowScalar(values, width, threshold, mask.Row(y));
+          }
+        }
+      });
+  });
+}
+
+// Single pass equivalent of GrayscaleConversion, BlurImage (radius 1),
+// ContourDetection and ApplyLevel. Each band of rows streams the color image
+// once through a rolling window of three grayscale rows and three blurred
+// rows, starting two rows above the band, so only the final bit packed mask
+// is written to edge_mask_. The blur and the Sobel filter are the stencils of
+// the staged chain, reading the rows outside the image through the same
+// border policy, so the output of 8-bit images is bit-identical. The window
+// rows keep the type T of the samples, so the wider images are thresholded
+// at their full precision instead of through 8-bit levels.
+template <typename T>
+void FusedEdgeMask(Content& content) {
+  const int32_t width = content.width;
+  const int32_t height = content.height;
+  EdgeMask& mask = content.edge_mask_;
+  mask.Resize(width, height);
+  const int32_t bands = content.thread_pool_.thread_count();
+  T* fused_rows = content.frame_arena_.Allocate<T>(bands*6*width);
+  uint8_t* contour_rows = content.frame_arena_.Allocate<uint8_t>(bands*width);
+  T* zero_row = content.frame_arena_.Allocate<T>(width);
+  std::fill(zero_row, zero_row+width, T(0));
+  // The exact magnitude is thresholded by comparing the squares, so no
+  // square root is taken and the contour row only holds 0 or 255.
+  const bool squared = content.magnitude_mode_ == MagnitudeMode::kSquared;
+  const int32_t threshold = content.level_threshold_;
+  const SobelOp sobel = {
+    content.magnitude_mode_, squared ? threshold*threshold : -1};
+  const EdgeOp<T> edge(content.magnitude_mode_, content.level_threshold_);
+  constexpr bool kBytes = std::is_same<T, uint8_t>::value;
+  const uint8_t contour_threshold =
+    squared || !kBytes ? 128u : content.level_threshold_;
+
+  WithBorder(content.border_policy_, [&](auto border) {
+    using Border = decltype(border);
+    content.thread_pool_.ParallelBands(
+      height, [&](int32_t band, int32_t begin, int32_t end) {
+        T* rows = fused_rows+band*6*width;
+        uint8_t* contour_row = contour_rows+band*width;
+        auto grayscale_row = [&](int32_t y) { return rows+(y%3)*width; };
+        auto blurred_row = [&](int32_t y) { return rows+(3+y%3)*width; };
+        // The rows y-1, y and y+1 of a window, resolved through Border. The
+        // rows outside the image map to rows of the window.
+        auto window = [&](int32_t y, auto row, const T** window_rows) {
+          for (int32_t dy=-1; dy<=1; ++dy) {
+            const int32_t index = Border::Index(y+dy, height);
+            window_rows[dy+1] = index < 0 ? zero_row : row(index);
+          }
+        };
+
+        auto convert = [&](int32_t y) {
+          InputToGrayscale(content, y, 1, grayscale_row(y));
+        };
+
+        auto blur = [&](int32_t y) {
+          const T* window_rows[3];
+          window(y, grayscale_row, window_rows);
+          StencilRow<1, Border>(
+            window_rows, width, blurred_row(y), BlurOp<T>());
+        };
+
+        auto contour = [&](int32_t y) {
+          const T* window_rows[3];
+          window(y, blurred_row, window_rows);
+          if constexpr (kBytes) {
+            SobelRow<Border>(
+              content.simd_level_, window_rows, width, contour_row, sobel);
+          } else {
+            EdgeRow<Border>(
+              content.simd_level_, window_rows, width, contour_row, edge);
+          }
+          PackEdgeRow(
+            content.simd_level_, contour_row, width, contour_threshold,
+            mask.Row(y));
+        };
+
+        // Mask rows [begin, end) need the blurred rows [begin-1, end+1),
+        // which need the grayscale rows [begin-2, end+2), all clipped to
+        // the image.
+        int32_t next_grayscale = std::max(begin-2, 0);
+        int32_t next_contour = begin;
+        for (int32_t y=std::max(begin-1, 0); y<=std::min(end, height-1); ++y) {
+          while (next_grayscale <= std::min(y+1, height-1)) {
+            convert(next_grayscale++);
+          }
+          blur(y);
+          while (next_contour < end && next_contour+1 <= y) {
+            contour(next_contour++);
+          }
+        }
+        while (next_contour < end) {
+          contour(next_contour++);
+        }
+      });
+  });
+}
+
+void FusedEdgeMask(Content& content) {
+  ScopedTimer timer(content.profiler_, "FusedEdgeMask");
+  WithPixelType(content.image_pixel_type_, [&](auto sample) {
+    FusedEdgeMask<decltype(sample)>(content);
+  });
+}
+
+void ClearImage(Content& content) {
+  ScopedTimer timer(content.profiler_, "ClearImage");
+  content.image_data_color_.assign(
+    size_t(content.width)*content.height, kColorBlack);
+}
+
+// Color `index` of the counter stream of rng_seed, each channel in the upper
+// 90% of its range so no color is mistaken for the black of the edges. The
+// stream is a portable hash, so the colors do not depend on the standard
+// library.
+uint32_t RandomColor(uint64_t rng_seed, uint64_t index) {
+  const uint64_t random =
+    CounterRandom(CounterRandom(rng_seed, ~uint64_t(0)), index);
+  uint8_t color[3];
+  for (int32_t c=0; c<3; ++c) {
+    const float u = static_cast<float>((random>>(c*21))&0x1FFFFF)/(1<<21);
+    color[c] = static_cast<uint8_t>((u*0.9f+0.1f)*255);
+  }
+  return PackColor(color[0], color[1], color[2]);
+}
+
+// Seeds come from PlaceSeeds, so every seed lands on a distinct non-edge
+// pixel and seed_count_ is met whenever the mask has room for it. Their
+// colors are drawn from a second counter stream, one value per seed.
+void AddSeeds(Content& content) {
+  ScopedTimer timer(content.profiler_, "AddSeeds");
+  PlaceSeeds(
+    content.edge_mask_, content.seed_count_, content.rng_seed_,
+    content.seed_placement_, content.frame_arena_, content.seeds_);
+  for (size_t s=0; s<content.seeds_.size(); ++s) {
+    content.image_data_color_[
+      content.seeds_[s].second*content.width+content.seeds_[s].first] =
+      RandomColor(content.rng_seed_, s);
+  }
+}
+
+// Scanline flood fill: the region around each seed is painted one
+// horizontal run at a time and only the rows above and below the runs are
+// pushed, so the work follows the number of runs instead of four stack
+// pushes per pixel. The span stack lives in Content and keeps its capacity
+// from one frame to the next.
+// owners records which seed painted each pixel. When a fill repaints a
+// pixel of another seed, or two seeds share a pixel, that seed is merged
+// into the current one in O(1) through seed_parents and is not filled.
+// Once every seed is done, seeds_ only keeps the surviving seeds.
+void FloodFill(Content& content) {
+  ScopedTimer timer(content.profiler_, "FloodFill");
+  const int32_t width = content.width;
+  const int32_t height = content.height;
+  const EdgeMask& mask = content.edge_mask_;
+  uint32_t* image_color = content.image_data_color_.data();
+  std::vector<FillSpan>& spans = content.fill_spans_;
+  const uint32_t seed_count = static_cast<uint32_t>(content.seeds_.size());
+  uint32_t* owners = content.frame_arena_.Allocate<uint32_t>(width*height);
+  uint32_t* seed_parents = content.frame_arena_.Allocate<uint32_t>(seed_count);
+  std::fill(owners, owners+width*height, kNoSeed);
+  auto merge = [&](uint32_t merged, uint32_t survivor) {
+    if (merged != kNoSeed && merged != survivor &&
+        seed_parents[merged] == merged) {
+      seed_parents[merged] = survivor;
+    }
+  };
+  for (uint32_t s=0; s<seed_count; ++s) {
+    seed_parents[s] = s;
+    const int32_t x = content.seeds_[s].first;
+    const int32_t y = content.seeds_[s].second;
+    merge(owners[y*width+x], s);
+    owners[y*width+x] = s;
+  }
+
+  for (uint32_t s=0; s<seed_count; ++s) {
+    if (seed_parents[s] != s) {
+      continue;
+    }
+    const int32_t seed_x = content.seeds_[s].first;
+    const int32_t seed_y = content.seeds_[s].second;
+    const uint32_t seed_color = image_color[seed_y*width+seed_x];
+
+    auto inside = [&](int32_t x, int32_t y) {
+      if (x < 0 || x >= width || y < 0 || y >= height) {
+        return false;
+      }
+      return !mask.IsEdge(x, y) && image_color[y*width+x] != seed_color;
+    };
+    auto set = [&](int32_t x, int32_t y) {
+      merge(owners[y*width+x], s);
+      owners[y*width+x] = s;
+      image_color[y*width+x] = seed_color;
+    };
+    auto fill = [&](int32_t x, int32_t y) {
+      if (!inside(x, y)) {
+        return;
+      }
+      spans.clear();
+      spans.push_back({x, x, y, 1});
+      spans.push_back({x, x, y-1, -1});
+      while (!spans.empty()) {
+        const FillSpan span = spans.back();
+        spans.pop_back();
+        int32_t x_begin = span.x_begin;
+        int32_t x = x_begin;
+        if (inside(x, span.y)) {
+          while (inside(x-1, span.y)) {
+            set(x-1, span.y);
+            --x;
+          }
+          if (x < x_begin) {
+            spans.push_back({x, x_begin-1, span.y-span.dy, -span.dy});
+          }
+        }
+        while (x_begin <= span.x_end) {
+          while (inside(x_begin, span.y)) {
+            set(x_begin, span.y);
+            ++x_begin;
+          }
+          if (x_begin > x) {
+            spans.push_back({x, x_begin-1, span.y+span.dy, span.dy});
+          }
+          if (x_begin-1 > span.x_end) {
+            spans.push_back(
+              {span.x_end+1, x_begin-1, span.y-span.dy, -span.dy});
+          }
+          // Skips to the next pixel inside, jumping over whole words of
+          // edges.
+          ++x_begin;
+          if (span.y < 0 || span.y >= height) {
+            x_begin = std::max(x_begin, span.x_end);
+          }
+          while (x_begin < span.x_end) {
+            x_begin = std::min(mask.NextNonEdge(x_begin, span.y), span.x_end);
+            if (x_begin == span.x_end || inside(x_begin, span.y)) {
+              break;
+            }
+            ++x_begin;
+          }
+          x = x_begin;
+        }
+      }
+    };
+
+    // As before, the region grows from the four neighbours of the seed,
+    // which already holds the seed color.
+    fill(seed_x-1, seed_y);
+    fill(seed_x+1, seed_y);
+    fill(seed_x, seed_y-1);
+    fill(seed_x, seed_y+1);
+  }
+
+  uint32_t survivors = 0;
+  for (uint32_t s=0; s<seed_count; ++s) {
+    if (seed_parents[s] == s) {
+      content.seeds_[survivors++] = content.seeds_[s];
+    }
+  }
+  content.seeds_.resize(survivors);
+}
+
+// Accumulates runs of identical colors: a run adds its length to the R, G
+// and B bins (256 each, 32-bit) and sets the bit of its 24-bit color, packed
+// as r|g<<8|b<<16, in the shared 2^24 bit set. The band whose fetch_or finds
+// a word still zero lists it, so every used word is listed exactly once and
+// the bit set is counted and cleared without a 2 MiB sweep.
+struct ColorRuns {
+  uint32_t* bins;
+  std::atomic<uint64_t>* color_bits;
+  uint32_t* used_words;                 // kColorBitWords, shared
+  std::atomic<int32_t>* used_count;
+  uint32_t key = 0xFFFFFFFFu;
+  uint32_t length = 0;
+
+  void Add(uint32_t next_key) {
+    if (next_key != key) {
+      Flush();
+      key = next_key;
+    }
+    ++length;
+  }
+
+  void Flush() {
+    if (length == 0) {
+      return;
+    }
+    bins[key&0xFF] += length;
+    bins[256+((key>>8)&0xFF)] += length;
+    bins[512+(key>>16)] += length;
+    const uint64_t bit = uint64_t(1)<<(key&63);
+    std::atomic<uint64_t>& word = color_bits[key>>6];
+    // The bit is usually set already, a plain load then avoids the locked
+    // read-modify-write.
+    if ((word.load(std::memory_order_relaxed)&bit) == 0 &&
+        word.fetch_or(bit, std::memory_order_relaxed) == 0) {
+      used_words[used_count->fetch_add(1, std::memory_order_relaxed)] =
+        key>>6;
+    }
+    length = 0;
+  }
+};
+
+void CountColorsScalar(
+    const uint32_t* color, int32_t count, ColorRuns& runs) {
+  for (int32_t i=0; i<count; ++i) {
+    runs.Add(color[i]&kColorRGBBits);
+  }
+}
+
+#if SIMD_X86
+// The keys of 8 pixels are compared with the keys shifted by one pixel, so
+// a group that continues the current run costs one compare and one
+// movemask.
+SIMD_TARGET_SSE41
+void CountColorsSSE41(
+    const uint32_t* color, int32_t count, ColorRuns& runs) {
+  const __m128i rgb_bits = _mm_set1_epi32(kColorRGBBits);
+  alignas(16) uint32_t keys[8];
+  int32_t i = 0;
+  for (; i+8<=count; i+=8) {
+    const __m128i low = _mm_and_si128(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(color+i)), rgb_bits);
+    const __m128i high = _mm_and_si128(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(color+i+4)),
+      rgb_bits);
+    const __m128i previous = _mm_set1_epi32(static_cast<int32_t>(runs.key));
+    const __m128i low_shifted = _mm_alignr_epi8(low, previous, 12);
+    const __m128i high_shifted = _mm_alignr_epi8(high, low, 12);
+    const int32_t same =
+      _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(low, low_shifted)))|
+      (_mm_movemask_ps(
+        _mm_castsi128_ps(_mm_cmpeq_epi32(high, high_shifted)))<<4);
+    if (same == 0xFF) {
+      runs.length += 8;
+      continue;
+    }
+    _mm_store_si128(reinterpret_cast<__m128i*>(keys), low);
+    _mm_store_si128(reinterpret_cast<__m128i*>(keys+4), high);
+    for (int32_t k=0; k<8; ++k) {
+      runs.Add(keys[k]);
+    }
+  }
+  CountColorsScalar(color+i, count-i, runs);
+}
+
+// 8 pixels per register.
+SIMD_TARGET_AVX2
+void CountColorsAVX2(
+    const uint32_t* color, int32_t count, ColorRuns& runs) {
+  const __m256i rgb_bits = _mm256_set1_epi32(kColorRGBBits);
+  const __m256i rotate = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+  alignas(32) uint32_t keys[8];
+  int32_t i = 0;
+  for (; i+8<=count; i+=8) {
+    const __m256i current = _mm256_and_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(color+i)),
+      rgb_bits);
+    const __m256i shifted = _mm256_blend_epi32(
+      _mm256_permutevar8x32_epi32(current, rotate),
+      _mm256_set1_epi32(static_cast<int32_t>(runs.key)),
+      0x01);
+    const int32_t same = _mm256_movemask_ps(
+      _mm256_castsi256_ps(_mm256_cmpeq_epi32(current, shifted)));
+    if (same == 0xFF) {
+      runs.length += 8;
+      continue;
+    }
+    _mm256_store_si256(reinterpret_cast<__m256i*>(keys), current);
+    for (int32_t k=0; k<8; ++k) {
+      runs.Add(keys[k]);
+    }
+  }
+  CountColorsScalar(color+i, count-i, runs);
+}
+#endif
+
+void CountColors(
+    SimdLevel level, const uint32_t* color, int32_t count, ColorRuns& runs) {
+#if SIMD_X86
+  if (level == SimdLevel::kAVX2) {
+    CountColorsAVX2(color, count, runs);
+    return;
+  }
+  if (level == SimdLevel::kSSE41) {
+    CountColorsSSE41(color, count, runs);
+    return;
+  }
+#endif
+  CountColorsScalar(color, count, runs);
+}
+
+// Each band counts its pixels into private 32-bit bins, summed in band
+// order into color_histogram_, and sets the colors it sees in the one
+// shared bit set, so the memory does not grow with the thread count and the
+// result does not depend on it. cell_count_ is the exact number of distinct
+// colors, without the black of the edges and of the pixels no seed reached.
+// Only the used words of the bit set are touched, and they are left cleared.
+void ComputeHistogram(Content& content) {
+  ScopedTimer timer(content.profiler_, "ComputeHistogram");
+  const int32_t bands = content.thread_pool_.thread_count();
+  uint32_t* histogram = content.frame_arena_.Allocate<uint32_t>(bands*3*256);
+  std::fill(histogram, histogram+bands*3*256, 0u);
+  if (content.color_bits_.empty()) {
+    content.color_bits_ = std::vector<std::atomic<uint64_t>>(kColorBitWords);
+    content.color_words_.resize(kColorBitWords);
+  }
+  std::atomic<int32_t> used_count{0};
+  const uint32_t* image_color = content.image_data_color_.data();
+  content.thread_pool_.ParallelBands(
+    content.width*content.height,
+    [&](int32_t band, int32_t begin, int32_t end) {
+      ColorRuns runs;
+      runs.bins = histogram+band*3*256;
+      runs.color_bits = content.color_bits_.data();
+      runs.used_words = content.color_words_.data();
+      runs.used_count = &used_count;
+      CountColors(
+        content.simd_level_, image_color+begin, end-begin, runs);
+      runs.Flush();
+    });
+  std::copy(histogram, histogram+3*256, content.color_histogram_.begin());
+  for (int32_t band=1; band<bands; ++band) {
+    for (int32_t i=0; i<3*256; ++i) {
+      content.color_histogram_[i] += histogram[band*3*256+i];
+    }
+  }
+
+  std::atomic<uint64_t>* color_bits = content.color_bits_.data();
+  // Black, the color of the edges and of the pixels no seed reached.
+  content.cell_count_ =
+    -static_cast<int32_t>(color_bits[0].load(std::memory_order_relaxed)&1u);
+  for (int32_t i=0; i<used_count.load(std::memory_order_relaxed); ++i) {
+    const uint32_t word = content.color_words_[i];
+    content.cell_count_ +=
+      PopCount(color_bits[word].load(std::memory_order_relaxed));
+    color_bits[word].store(0u, std::memory_order_relaxed);
+  }
+}
+
+uint32_t FindRoot(uint32_t* parents, uint32_t i) {
+  uint32_t root = i;
+  while (parents[root] != root) {
+    root = parents[root];
+  }
+  while (parents[i] != root) {
+    uint32_t next = parents[i];
+    parents[i] = root;
+    i = next;
+  }
+  return root;
+}
+
+// Links the larger root under the smaller one, so every parent index is
+// lower than its child and the root of a cell is its first pixel in raster
+// order.
+void UnionCells(uint32_t* parents, uint32_t a, uint32_t b) {
+  a = FindRoot(parents, a);
+  b = FindRoot(parents, b);
+  if (a < b) {
+    parents[b] = a;
+  } else if (b < a) {
+    parents[a] = b;
+  }
+}
+
+// Calls visit(x) for every pixel of row y that is not an edge, in increasing
+// x. Whole words of edges cost a single test.
+template <typename Visitor>
+void ForEachNonEdge(const EdgeMask& mask, int32_t y, const Visitor& visit) {
+  const uint64_t* row = mask.Row(y);
+  for (int32_t word=0; word<mask.words_per_row; ++word) {
+    uint64_t free_bits = ~row[word];
+    while (free_bits != 0) {
+      visit(word*64+EdgeMask::CountTrailingZeros(free_bits));
+      free_bits &= free_bits-1;
+    }
+  }
+}
+
+// Numbers the roots of a forest over the non-edge pixels of mask,
+// parents[i] == i, in raster order, writes the label of every pixel's root
+// to labels, kEdgeLabel on the edges, and returns the number of roots. Each
+// band counts its roots, the counts are summed serially, then every band
+// numbers its roots and resolves its pixels. Only the resolve writes labels
+// of non-root pixels and it reads parents without changing them, so the
+// bands never race.
+uint32_t NumberRoots(
+    const EdgeMask& mask, const uint32_t* parents, ThreadPool& thread_pool,
+    FrameArena& arena, uint32_t* labels) {
+  const int32_t width = mask.width;
+  const int32_t height = mask.height;
+  const int32_t bands = thread_pool.thread_count();
+  uint32_t* band_roots = arena.Allocate<uint32_t>(bands+1);
+  std::fill(band_roots, band_roots+bands+1, 0u);
+
+  thread_pool.ParallelBands(
+    height, [&](int32_t band, int32_t begin, int32_t end) {
+      uint32_t roots = 0;
+      for (int32_t y=begin; y<end; ++y) {
+        ForEachNonEdge(mask, y, [&](int32_t x) {
+          const uint32_t i = y*width+x;
+          roots += parents[i] == i;
+        });
+      }
+      band_roots[band+1] = roots;
+    });
+  for (int32_t band=0; band<bands; ++band) {
+    band_roots[band+1] += band_roots[band];
+  }
+  thread_pool.ParallelBands(
+    height, [&](int32_t band, int32_t begin, int32_t end) {
+      uint32_t label = band_roots[band];
+      for (int32_t y=begin; y<end; ++y) {
+        ForEachNonEdge(mask, y, [&](int32_t x) {
+          const uint32_t i = y*width+x;
+          if (parents[i] == i) {
+            labels[i] = ++label;
+          }
+        });
+      }
+    });
+  thread_pool.ParallelBands(
+    height, [&](int32_t, int32_t begin, int32_t end) {
+      for (int32_t y=begin; y<end; ++y) {
+        uint32_t* row_labels = labels+size_t(y)*width;
+        const uint64_t* row = mask.Row(y);
+        for (int32_t x=0; x<width; ++x) {
+          if ((row[x>>6]>>(x&63))&1u) {
+            row_labels[x] = kEdgeLabel;
+            continue;
+          }
+          const uint32_t i = y*width+x;
+          if (parents[i] != i) {
+            uint32_t root = parents[i];
+            while (parents[root] != root) {
+              root = parents[root];
+            }
+            row_labels[x] = labels[root];
+          }
+        }
+      }
+    });
+  return band_roots[bands];
+}
+
+// Labels the 4-connected regions of non-edge pixels of mask with a
+// union-find over pixel indices and returns their number. Each band builds
+// and flattens its own forest, the forests are merged serially along the
+// band seams, then every band numbers its roots and resolves its pixels.
+// Labels are assigned in raster order of the first pixel of each region, so
+// they do not depend on the thread count. Edge pixels are never visited, so
+// their parents are left undefined.
+uint32_t LabelMask(
+    const EdgeMask& mask, ThreadPool& thread_pool, FrameArena& arena,
+    uint32_t* labels) {
+  const int32_t width = mask.width;
+  const int32_t height = mask.height;
+  uint32_t* parents = arena.Allocate<uint32_t>(size_t(width)*height);
+  const int32_t bands = thread_pool.thread_count();
+
+  // First pass: local forests, whose parents stay inside the band.
+  thread_pool.ParallelBands(
+    height, [&](int32_t, int32_t begin, int32_t end) {
+      for (int32_t y=begin; y<end; ++y) {
+        const uint64_t* row = mask.Row(y);
+        const uint64_t* row_above = y > begin ? mask.Row(y-1) : nullptr;
+        uint64_t previous_free = 0;
+        uint64_t previous_above_free = 0;
+        for (int32_t word=0; word<mask.words_per_row; ++word) {
+          // Non-edge bits of the pixel, its left, top and top-left pixels.
+          const uint64_t row_free = ~row[word];
+          const uint64_t above_free = row_above ? ~row_above[word] : 0;
+          const uint64_t left_free = (row_free<<1)|(previous_free>>63);
+          const uint64_t above_left_free =
+            (above_free<<1)|(previous_above_free>>63);
+          previous_free = row_free;
+          previous_above_free = above_free;
+          for (uint64_t bits=row_free; bits!=0; bits&=bits-1) {
+            const int32_t bit = EdgeMask::CountTrailingZeros(bits);
+            const uint64_t pixel = uint64_t(1)<<bit;
+            const uint32_t i = y*width+word*64+bit;
+            if (left_free&pixel) {
+              // The left and top pixels are already linked through the
+              // top-left one when it is not an edge.
+              parents[i] = parents[i-1];
+              if ((above_free&pixel) && !(above_left_free&pixel)) {
+                UnionCells(parents, i-1, i-width);
+              }
+            } else if (above_free&pixel) {
+              parents[i] = parents[i-width];
+            } else {
+              parents[i] = i;
+            }
+          }
+        }
+      }
+      for (int32_t y=begin; y<end; ++y) {
+        ForEachNonEdge(mask, y, [&](int32_t x) {
+          const uint32_t i = y*width+x;
+          parents[i] = parents[parents[i]];
+        });
+      }
+    });
+
+  // Merge step along the first row of every band.
+  for (int32_t band=1; band<bands; ++band) {
+    const int32_t y = static_cast<int32_t>(int64_t(height)*band/bands);
+    if (y == 0 || y >= height) {
+      continue;
+    }
+    ForEachNonEdge(mask, y, [&](int32_t x) {
+      if (!mask.IsEdge(x, y-1)) {
+        UnionCells(parents, y*width+x, (y-1)*width+x);
+      }
+    });
+  }
+
+  return NumberRoots(mask, parents, thread_pool, arena, labels);
+}
+
+// Labels the cells of edge_mask_ into labels_, cell_count_ being the exact
+// number of regions.
+void LabelCells(Content& content) {
+  ScopedTimer timer(content.profiler_, "LabelCells");
+  content.labels_.resize(size_t(content.width)*content.height);
+  content.cell_count_ = LabelMask(
+    content.edge_mask_, content.thread_pool_, content.frame_arena_,
+    content.labels_.data());
+}
+
+// Same labels as LabelCells with the full resolution work restricted to the
+// surroundings of the edges. The edge mask is reduced to blocks of
+// 2^pyramid_levels_ pixels, a block being an edge when any of its pixels
+// is, which equals thresholding the max-pooled magnitudes, and the coarse
+// cells are labelled by LabelMask. The pixels of an edge-free block are all
+// connected, so they take the cell of their block. Only the non-edge
+// pixels of the boundary blocks go through a union-find at full resolution,
+// each coarse cell being one node: the top-left pixel of its first block,
+// which is its first pixel in raster order. Every node is then the first
+// pixel of what it stands for, so the roots are the first pixels of the
+// cells and the numbering matches LabelCells. The union-find follows the
+// number of boundary blocks, that is the length of the edges, and the other
+// blocks are only filled. The labels are therefore exact; verify_pyramid_
+// checks it against LabelMask and counts the pixels off in
+// pyramid_mismatches_, without touching the labels.
+void PyramidLabelCells(Content& content) {
+  ScopedTimer timer(content.profiler_, "PyramidLabelCells");
+  const int32_t width = content.width;
+  const int32_t height = content.height;
+  const EdgeMask& mask = content.edge_mask_;
+  ThreadPool& thread_pool = content.thread_pool_;
+  FrameArena& arena = content.frame_arena_;
+  const int32_t levels = std::clamp(content.pyramid_levels_, 1, 6);
+  const int32_t block = 1<<levels;
+  const uint64_t block_bits = ~uint64_t(0)>>(64-block);
+  std::vector<uint32_t>& labels = content.labels_;
+  labels.resize(size_t(width)*height);
+
+  // Coarse level. The padding bits of the mask make the blocks cut by the
+  // right side boundary blocks.
+  EdgeMask& coarse = content.coarse_mask_;
+  coarse.Resize((width+block-1)>>levels, (height+block-1)>>levels);
+  thread_pool.ParallelBands(
+    coarse.height, [&](int32_t, int32_t begin, int32_t end) {
+      for (int32_t by=begin; by<end; ++by) {
+        uint64_t* coarse_row = coarse.Row(by);
+        std::fill(coarse_row, coarse_row+coarse.words_per_row, 0u);
+        for (int32_t bx=coarse.width; bx<coarse.words_per_row*64; ++bx) {
+          coarse_row[bx>>6] |= uint64_t(1)<<(bx&63);
+        }
+        const int32_t y_end = std::min(height, (by+1)<<levels);
+        for (int32_t bx=0; bx<coarse.width; ++bx) {
+          const int32_t x = bx<<levels;
+          for (int32_t y=by<<levels; y<y_end; ++y) {
+            if ((mask.Row(y)[x>>6]>>(x&63))&block_bits) {
+              coarse_row[bx>>6] |= uint64_t(1)<<(bx&63);
+              break;
+            }
+          }
+        }
+      }
+    });
+  const size_t coarse_size = size_t(coarse.width)*coarse.height;
+  uint32_t* coarse_labels = arena.Allocate<uint32_t>(coarse_size);
+  const uint32_t coarse_cells =
+    LabelMask(coarse, thread_pool, arena, coarse_labels);
+
+  // Node of every coarse cell. Labels grow in raster order of the first
+  // block of each cell, so the first block of cell k comes after those of
+  // the cells before it.
+  uint32_t* parents = arena.Allocate<uint32_t>(size_t(width)*height);
+  uint32_t* cell_nodes = arena.Allocate<uint32_t>(coarse_cells);
+  uint32_t found = 0;
+  for (size_t b=0; b<coarse_size && found<coarse_cells; ++b) {
+    if (coarse_labels[b] == found+1) {
+      const uint32_t node = (uint32_t(b/coarse.width)<<levels)*width+
+        (uint32_t(b%coarse.width)<<levels);
+      cell_nodes[found++] = node;
+      parents[node] = node;
+    }
+  }
+  auto is_boundary = [&](int32_t x, int32_t y) {
+    return coarse.IsEdge(x>>levels, y>>levels);
+  };
+  auto node = [&](int32_t x, int32_t y) {
+    return is_boundary(x, y) ? uint32_t(y*width+x) : cell_nodes[
+      coarse_labels[(y>>levels)*coarse.width+(x>>levels)]-1];
+  };
+  // Calls visit(x, y) for the non-edge pixels of the boundary blocks.
+  auto for_each_boundary_pixel = [&](const auto& visit) {
+    for (int32_t by=0; by<coarse.height; ++by) {
+      const int32_t y_end = std::min(height, (by+1)<<levels);
+      for (int32_t bx=0; bx<coarse.width; ++bx) {
+        if (!coarse.IsEdge(bx, by)) {
+          continue;
+        }
+        const int32_t x_end = std::min(width, (bx+1)<<levels);
+        for (int32_t y=by<<levels; y<y_end; ++y) {
+          for (int32_t x=bx<<levels; x<x_end; ++x) {
+            if (!mask.IsEdge(x, y)) {
+              visit(x, y);
+            }
+          }
+        }
+      }
+    }
+  };
+
+  // Full resolution union-find over the boundary pixels and the cells.
+  uint32_t boundary_pixels = 0;
+  for_each_boundary_pixel([&](int32_t x, int32_t y) {
+    parents[y*width+x] = y*width+x;
+    ++boundary_pixels;
+  });
+  for_each_boundary_pixel([&](int32_t x, int32_t y) {
+    const uint32_t i = y*width+x;
+    if (x > 0 && !mask.IsEdge(x-1, y)) {
+      UnionCells(parents, i, node(x-1, y));
+    }
+    if (x < width-1 && !mask.IsEdge(x+1, y)) {
+      UnionCells(parents, i, node(x+1, y));
+    }
+    if (y > 0 && !mask.IsEdge(x, y-1)) {
+      UnionCells(parents, i, node(x, y-1));
+    }
+    if (y < height-1 && !mask.IsEdge(x, y+1)) {
+      UnionCells(parents, i, node(x, y+1));
+    }
+  });
+
+  // Numbers the roots in raster order, then flattens the nodes so the fill
+  // below only reads.
+  uint32_t* roots = arena.Allocate<uint32_t>(coarse_cells+boundary_pixels);
+  uint32_t root_count = 0;
+  for (uint32_t k=0; k<coarse_cells; ++k) {
+    if (FindRoot(parents, cell_nodes[k]) == cell_nodes[k]) {
+      roots[root_count++] = cell_nodes[k];
+    }
+  }
+  for_each_boundary_pixel([&](int32_t x, int32_t y) {
+    const uint32_t i = y*width+x;
+    if (FindRoot(parents, i) == i) {
+      roots[root_count++] = i;
+    }
+  });
+  std::sort(roots, roots+root_count);
+  uint32_t* root_labels = arena.Allocate<uint32_t>(size_t(width)*height);
+  for (uint32_t r=0; r<root_count; ++r) {
+    root_labels[roots[r]] = r+1;
+  }
+  uint32_t* cell_labels = arena.Allocate<uint32_t>(coarse_cells);
+  for (uint32_t k=0; k<coarse_cells; ++k) {
+    cell_labels[k] = root_labels[FindRoot(parents, cell_nodes[k])];
+  }
+  for_each_boundary_pixel([&](int32_t x, int32_t y) {
+    FindRoot(parents, y*width+x);
+  });
+
+  thread_pool.ParallelBands(
+    height, [&](int32_t, int32_t begin, int32_t end) {
+      for (int32_t y=begin; y<end; ++y) {
+        const int32_t by = y>>levels;
+        uint32_t* row_labels = labels.data()+size_t(y)*width;
+        for (int32_t bx=0; bx<coarse.width; ++bx) {
+          const int32_t x_begin = bx<<levels;
+          const int32_t x_end = std::min(width, x_begin+block);
+          if (!coarse.IsEdge(bx, by)) {
+            std::fill(
+              row_labels+x_begin, row_labels+x_end,
+              cell_labels[coarse_labels[by*coarse.width+bx]-1]);
+            continue;
+          }
+          for (int32_t x=x_begin; x<x_end; ++x) {
+            row_labels[x] = mask.IsEdge(x, y) ?
+              kEdgeLabel : root_labels[parents[y*width+x]];
+          }
+        }
+      }
+    });
+  content.cell_count_ = root_count;
+
+  content.pyramid_mismatches_ = -1;
+  if (content.verify_pyramid_) {
+    uint32_t* exact = arena.Allocate<uint32_t>(size_t(width)*height);
+    LabelMask(mask, thread_pool, arena, exact);
+    int64_t mismatches = 0;
+    for (size_t i=0; i<labels.size(); ++i) {
+      mismatches += labels[i] != exact[i];
+    }
+    content.pyramid_mismatches_ = mismatches;
+  }
+}
+
+// Same cells as LabelCells, found the data-parallel way a GPU would: every
+// non-edge pixel starts with its own index and repeatedly takes the minimum
+// of its 4-neighbours, so each cell converges to the index of its first
+// pixel in raster order, which NumberRoots treats as its root. A label is
+// always the index of a pixel of the same cell, so after each update the
+// pixel jumps to the label of that pixel while it lies in the band, which
+// collapses long chains at once. Every sweep runs the bands in place,
+// forward then backward. The bands only see the rows of their neighbours
+// through copies of their first and last rows, double-buffered by sweep
+// parity, so no band reads a row another one is writing. The sweeps stop
+// as soon as one changes nothing.
+void PropagateLabels(Content& content) {
+  ScopedTimer timer(content.profiler_, "PropagateLabels");
+  const int32_t width = content.width;
+  const int32_t height = content.height;
+  const EdgeMask& mask = content.edge_mask_;
+  FrameArena& arena = content.frame_arena_;
+  ThreadPool& thread_pool = content.thread_pool_;
+  const int32_t bands = thread_pool.thread_count();
+  const uint32_t kNoLabel = ~uint32_t(0);  // Edges, above every label
+  uint32_t* minimums = arena.Allocate<uint32_t>(size_t(width)*height);
+  uint32_t* outside_row = arena.Allocate<uint32_t>(width);
+  std::fill(outside_row, outside_row+width, kNoLabel);
+  uint8_t* band_changed = arena.Allocate<uint8_t>(bands);
+  // First and last row of every band, for each sweep parity.
+  uint32_t* boundary_rows = arena.Allocate<uint32_t>(size_t(4)*bands*width);
+  auto boundary_row = [&](int32_t parity, int32_t band, int32_t last) {
+    return boundary_rows+((size_t(parity)*bands+band)*2+last)*width;
+  };
+  auto publish_boundaries = [&](
+      int32_t parity, int32_t band, int32_t begin, int32_t end) {
+    std::copy_n(minimums+size_t(begin)*width, width,
+                boundary_row(parity, band, 0));
+    std::copy_n(minimums+size_t(end-1)*width, width,
+                boundary_row(parity, band, 1));
+  };
+  // Band holding row y, the inverse of the split of ParallelBands.
+  auto owner = [&](int32_t y) {
+    return static_cast<int32_t>(((int64_t(y)+1)*bands-1)/height);
+  };
+
+  thread_pool.ParallelBands(
+    height, [&](int32_t band, int32_t begin, int32_t end) {
+      for (int32_t y=begin; y<end; ++y) {
+        const uint64_t* edges = mask.Row(y);
+        uint32_t* row = minimums+size_t(y)*width;
+        for (int32_t x=0; x<width; ++x) {
+          row[x] = (edges[x>>6]>>(x&63))&1u ? kNoLabel : y*width+x;
+        }
+      }
+      publish_boundaries(0, band, begin, end);
+    });
+
+  int32_t parity = 0;
+  bool changed = true;
+  while (changed) {
+    std::fill(band_changed, band_changed+bands, 0u);
+    thread_pool.ParallelBands(
+      height, [&](int32_t band, int32_t begin, int32_t end) {
+        const uint32_t* above =
+          begin > 0 ? boundary_row(parity, owner(begin-1), 1) : outside_row;
+        const uint32_t* below =
+          end < height ? boundary_row(parity, owner(end), 0) : outside_row;
+        const uint32_t band_begin = begin*width;
+        const uint32_t band_size = (end-begin)*width;
+        auto jump = [&](uint32_t label) {
+          while (label-band_begin < band_size && minimums[label] < label) {
+            label = minimums[label];
+          }
+          return label;
+        };
+        bool band_change = false;
+        for (int32_t y=begin; y<end; ++y) {
+          const uint64_t* edges = mask.Row(y);
+          uint32_t* row = minimums+size_t(y)*width;
+          const uint32_t* up = y > begin ? row-width : above;
+          for (int32_t x=0; x<width; ++x) {
+            if ((edges[x>>6]>>(x&63))&1u) {
+              continue;
+            }
+            uint32_t label = std::min(row[x], up[x]);
+            if (x > 0) {
+              label = std::min(label, row[x-1]);
+            }
+            label = jump(label);
+            band_change |= label != row[x];
+            row[x] = label;
+          }
+        }
+        for (int32_t y=end-1; y>=begin; --y) {
+          const uint64_t* edges = mask.Row(y);
+          uint32_t* row = minimums+size_t(y)*width;
+          const uint32_t* down = y < end-1 ? row+width : below;
+          for (int32_t x=width-1; x>=0; --x) {
+            if ((edges[x>>6]>>(x&63))&1u) {
+              continue;
+            }
+            uint32_t label = std::min(row[x], down[x]);
+            if (x < width-1) {
+              label = std::min(label, row[x+1]);
+            }
+            label = jump(label);
+            band_change |= label != row[x];
+            row[x] = label;
+          }
+        }
+        band_changed[band] = band_change;
+        publish_boundaries(parity^1, band, begin, end);
+      });
+    parity ^= 1;
+    changed = std::any_of(
+      band_changed, band_changed+bands, [](uint8_t c) { return c != 0; });
+  }
+
+  content.labels_.resize(size_t(width)*height);
+  content.cell_count_ = NumberRoots(
+    mask, minimums, thread_pool, arena, content.labels_.data());
+}
+
+void BuildPalette(uint64_t rng_seed, uint32_t cell_count, uint32_t* palette) {
+  palette[0] = kColorBlack;
+  for (uint32_t i=1; i<=cell_count; ++i) {
+    palette[i] = RandomColor(rng_seed, i);
+  }
+}
+
+// Colors every cell with a random color from a palette indexed by label.
+// Edges keep the black of ClearImage.
+void ColorizeLabels(Content& content) {
+  ScopedTimer timer(content.profiler_, "ColorizeLabels");
+  uint32_t* palette =
+    content.frame_arena_.Allocate<uint32_t>(size_t(content.cell_count_)+1);
+  BuildPalette(content.rng_seed_, content.cell_count_, palette);
+
+  const uint32_t* labels = content.labels_.data();
+  uint32_t* image_color = content.image_data_color_.data();
+  content.thread_pool_.ParallelBands(
+    content.width*content.height,
+    [&](int32_t, int32_t begin, int32_t end) {
+      for (int32_t i=begin; i<end; ++i) {
+        image_color[i] = palette[labels[i]];
+      }
+    });
+}
+
+// Fills cell_stats_ from labels_ and the input pixels in a single pass. Each
+// band accumulates into its own slice of SoA accumulators, one entry per
+// cell, then the slices are reduced in band order, in parallel over the
+// cells, so the table does not depend on the thread count. The accumulators
+// take bands*cells entries of the arena.
+void ComputeCellStats(Content& content) {
+  ScopedTimer timer(content.profiler_, "ComputeCellStats");
+  const int32_t width = content.width;
+  const int32_t height = content.height;
+  const size_t cells = content.cell_count_;
+  CellStats& stats = content.cell_stats_;
+  stats.Resize(cells);
+  ThreadPool& thread_pool = content.thread_pool_;
+  const int32_t bands = thread_pool.thread_count();
+  FrameArena& arena = content.frame_arena_;
+  const size_t slots = cells*bands;
+  uint32_t* area = arena.Allocate<uint32_t>(slots);
+  int32_t* min_x = arena.Allocate<int32_t>(slots);
+  int32_t* min_y = arena.Allocate<int32_t>(slots);
+  int32_t* max_x = arena.Allocate<int32_t>(slots);
+  int32_t* max_y = arena.Allocate<int32_t>(slots);
+  uint64_t* sum_x = arena.Allocate<uint64_t>(slots);
+  uint64_t* sum_y = arena.Allocate<uint64_t>(slots);
+  double* sum_color = arena.Allocate<double>(slots*3);
+  std::fill(area, area+slots, 0u);
+  std::fill(min_x, min_x+slots, width);
+  std::fill(min_y, min_y+slots, height);
+  std::fill(max_x, max_x+slots, -1);
+  std::fill(max_y, max_y+slots, -1);
+  std::fill(sum_x, sum_x+slots, 0u);
+  std::fill(sum_y, sum_y+slots, 0u);
+  std::fill(sum_color, sum_color+slots*3, 0.0);
+
+  const uint32_t* labels = content.labels_.data();
+  const int32_t channels = content.image_channels_;
+  const int32_t green = channels == 3 ? 1 : 0;
+  const int32_t blue = channels == 3 ? 2 : 0;
+  // The integer samples of a run are summed exactly, in 64 bits for the
+  // 16-bit ones; the color sums are doubles, exact for 8-bit images. The
+  // means are then scaled to 8-bit levels.
+  double level_scale = 1.0;
+  WithPixelType(content.image_pixel_type_, [&](auto sample) {
+    using T = decltype(sample);
+    level_scale = 1.0/PixelTraits<T>::kScale;
+    using RunSum = std::conditional_t<
+      std::is_same<T, uint8_t>::value, uint32_t,
+      std::conditional_t<std::is_same<T, float>::value, double, uint64_t>>;
+    const T* pixels = reinterpret_cast<const T*>(content.image_pixels_);
+    thread_pool.ParallelBands(
+      height, [&](int32_t band, int32_t begin, int32_t end) {
+        const size_t first = cells*band;
+        for (int32_t y=begin; y<end; ++y) {
+          const uint32_t* row_labels = labels+size_t(y)*width;
+          const T* row_pixels = pixels+size_t(y)*width*channels;
+          // Accumulates whole runs of one label, so the accumulators of a
+          // cell are touched once per run instead of once per pixel.
+          for (int32_t x=0; x<width; ) {
+            const uint32_t label = row_labels[x];
+            const int32_t run_begin = x;
+            while (x < width && row_labels[x] == label) {
+              ++x;
+            }
+            if (label == kEdgeLabel) {
+              continue;
+            }
+            const size_t i = first+label-1;
+            const uint32_t run = x-run_begin;
+            area[i] += run;
+            min_x[i] = std::min(min_x[i], run_begin);
+            min_y[i] = std::min(min_y[i], y);
+            max_x[i] = std::max(max_x[i], x-1);
+            max_y[i] = std::max(max_y[i], y);
+            sum_x[i] += (uint64_t(run_begin)+x-1)*run/2;
+            sum_y[i] += uint64_t(y)*run;
+            RunSum r = 0;
+            RunSum g = 0;
+            RunSum b = 0;
+            for (int32_t j=run_begin; j<x; ++j) {
+              const T* pixel = row_pixels+j*channels;
+              r += pixel[0];
+              g += pixel[green];
+              b += pixel[blue];
+            }
+            sum_color[i*3+0] += r;
+            sum_color[i*3+1] += g;
+            sum_color[i*3+2] += b;
+          }
+        }
+      });
+  });
+
+  thread_pool.ParallelBands(
+    static_cast<int32_t>(cells), [&](int32_t, int32_t begin, int32_t end) {
+      for (int32_t c=begin; c<end; ++c) {
+        uint32_t cell_area = 0;
+        int32_t box[4] = {width, height, -1, -1};
+        uint64_t sums[2] = {};
+        double colors[3] = {};
+        for (int32_t band=0; band<bands; ++band) {
+          const size_t i = cells*band+c;
+          cell_area += area[i];
+          box[0] = std::min(box[0], min_x[i]);
+          box[1] = std::min(box[1], min_y[i]);
+          box[2] = std::max(box[2], max_x[i]);
+          box[3] = std::max(box[3], max_y[i]);
+          sums[0] += sum_x[i];
+          sums[1] += sum_y[i];
+          colors[0] += sum_color[i*3+0];
+          colors[1] += sum_color[i*3+1];
+          colors[2] += sum_color[i*3+2];
+        }
+        const double inverse_area = cell_area ? 1.0/cell_area : 0.0;
+        stats.area[c] = cell_area;
+        stats.min_x[c] = box[0];
+        stats.min_y[c] = box[1];
+        stats.max_x[c] = box[2];
+        stats.max_y[c] = box[3];
+        stats.centroid_x[c] = static_cast<float>(sums[0]*inverse_area);
+        stats.centroid_y[c] = static_cast<float>(sums[1]*inverse_area);
+        stats.mean_r[c] =
+          static_cast<float>(colors[0]*inverse_area*level_scale);
+        stats.mean_g[c] =
+          static_cast<float>(colors[1]*inverse_area*level_scale);
+        stats.mean_b[c] =
+          static_cast<float>(colors[2]*inverse_area*level_scale);
+      }
+    });
+}
+
+// Forgets every cached stage, so the next frame recomputes everything.
+void InvalidateStages(Content& content) {
+  content.contour_stage_.valid = false;
+  content.level_stage_.valid = false;
+  content.cells_stage_.valid = false;
+}
+
+// Times every band-parallel stage from 1 thread up to thread_count_ and
+// prints the speedup over the single thread run as a percentage to out.
+void ReportStageScaling(
+    Content& content, std::ostream& out, int32_t repetitions) {
+  struct Stage {
+    const char* name;
+    std::vector<uint8_t> input;  // image_data_grayscale_ before the stage
+    void (*run)(Content&);
+  };
+  // The repetitions would flood the profile.
+  Profiler* profiler = content.profiler_;
+  content.profiler_ = nullptr;
+  content.thread_pool_.Resize(1);
+  std::vector<Stage> stages;
+  stages.push_back({"GrayscaleConversion", {}, GrayscaleConversion});
+  GrayscaleConversion(content);
+  stages.push_back({"BlurImage", content.image_data_grayscale_, BlurImage});
+  BlurImage(content);
+  stages.push_back(
+    {"ContourDetection", content.image_data_grayscale_, ContourDetection});
+  ContourDetection(content);
+  stages.push_back({"ApplyLevel", content.image_data_grayscale_, ApplyLevel});
+  ApplyLevel(content);
+  // ComputeHistogram counts the colors of a flood fill.
+  ClearImage(content);
+  AddSeeds(content);
+  FloodFill(content);
+  stages.push_back({"LabelCells", {}, LabelCells});
+  stages.push_back({"PropagateLabels", {}, PropagateLabels});
+  stages.push_back({"PyramidLabelCells", {}, PyramidLabelCells});
+  stages.push_back({"FusedEdgeMask", {}, FusedEdgeMask});
+  stages.push_back({"ComputeHistogram", {}, ComputeHistogram});
+
+  ThreadPool sizing(content.thread_count_);
+  const int32_t max_threads = sizing.thread_count();
+  for (Stage& stage : stages) {
+    double single_thread_ms = 0.0;
+    for (int32_t threads=1; threads<=max_threads; ++threads) {
+      content.thread_pool_.Resize(threads);
+      std::vector<double> timings;
+      for (int32_t i=0; i<repetitions; ++i) {
+        if (!stage.input.empty()) {
+          content.image_data_grayscale_ = stage.input;
+        }
+        content.frame_arena_.Reset();
+        auto start = std::chrono::steady_clock::now();
+        stage.run(content);
+        auto end = std::chrono::steady_clock::now();
+        timings.push_back(
+          std::chrono::duration<double, std::milli>(end-start).count());
+      }
+      std::nth_element(
+        timings.begin(), timings.begin()+timings.size()/2, timings.end());
+      const double median_ms = timings[timings.size()/2];
+      if (threads == 1) {
+        single_thread_ms = median_ms;
+      }
+      out << stage.name << " threads " << threads << ": "
+        << median_ms << " ms, speedup "
+        << (single_thread_ms/median_ms-1.0)*100.0 << "%" << std::endl;
+    }
+  }
+  content.thread_pool_.Resize(content.thread_count_);
+  content.profiler_ = profiler;
+  InvalidateStages(content);
+}
+
+// The stages form a chain of cached nodes: the contour magnitudes depend on
+// the image, the blur radius, the border policy and the magnitude mode, the
+// edge mask on the contour and the threshold, and the cells on the mask, the
+// fill mode, the seed count and the RNG seed. A call only recomputes the
+// nodes downstream of what changed.
+bool ComputeSegmentation(Content& content) {
+  ScopedTimer timer(content.profiler_, "ComputeSegmentation");
+  content.frame_arena_.Reset();
+  const uint64_t cells_version = content.cells_stage_.version;
+  const uint64_t fused =
+    content.use_fused_pipeline_ && content.blur_radius_ == 1;
+  const uint64_t border = static_cast<uint64_t>(content.border_policy_);
+  const uint64_t magnitude = static_cast<uint64_t>(content.magnitude_mode_);
+  if (fused) {
+    // The fused path does not keep the contour magnitudes, so it reruns
+    // entirely when the threshold changes.
+    if (content.level_stage_.Update(
+          {fused, content.image_version_, uint64_t(content.blur_radius_),
+           border, magnitude, content.level_threshold_})) {
+      FusedEdgeMask(content);
+    }
+  } else {
+    if (content.contour_stage_.Update(
+          {content.image_version_, uint64_t(content.blur_radius_),
+           border, magnitude})) {
+      GrayscaleConversion(content);
+      BlurImage(content);
+      ContourDetection(content);
+    }
+    if (content.level_stage_.Update(
+          {fused, content.contour_stage_.version,
+           content.level_threshold_})) {
+      ApplyLevel(content);
+    }
+  }
+  const uint64_t fill_mode = static_cast<uint64_t>(content.fill_mode_);
+  if (content.cells_stage_.Update(
+        {content.level_stage_.version, fill_mode,
+         uint64_t(content.seed_count_), content.rng_seed_,
+         static_cast<uint64_t>(content.seed_placement_),
+         content.compute_cell_stats_, uint64_t(content.pyramid_levels_),
+         content.verify_pyramid_})) {
+    ClearImage(content);
+    if (content.fill_mode_ == FillMode::kConnectedComponents) {
+      LabelCells(content);
+      ColorizeLabels(content);
+    } else if (content.fill_mode_ == FillMode::kLabelPropagation) {
+      PropagateLabels(content);
+      ColorizeLabels(content);
+    } else if (content.fill_mode_ == FillMode::kPyramid) {
+      PyramidLabelCells(content);
+      ColorizeLabels(content);
+    } else {
+      AddSeeds(content);
+      FloodFill(content);
+      ComputeHistogram(content);
+    }
+    // The flood fill cells are only colors, so only the labelled modes
+    // have statistics.
+    if (content.compute_cell_stats_ &&
+        content.fill_mode_ != FillMode::kFloodFill) {
+      ComputeCellStats(content);
+    } else {
+      content.cell_stats_.Resize(0);
+    }
+  }
+  return content.cells_stage_.version != cells_version;
+}
@@ -0,0 +1,236 @@
+#ifndef PRACTICAL_MARKED_SEGMENTATION_H_
+#define PRACTICAL_MARKED_SEGMENTATION_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "edge_mask.h"
+#include "frame_arena.h"
+#include "mapped_image.h"
+#include "pixel_type.h"
+#include "profiler.h"
+#include "seeds.h"
+#include "simd.h"
+#include "stencil.h"
+#include "thread_pool.h"
+
+const uint8_t kLevelThreshold = 32u;
+const uint32_t kEdgeLabel = 0u;
+const uint32_t kNoSeed = 0xFFFFFFFFu;
+const int32_t kColorBitWords = (1<<24)/64;  // One bit per 24-bit color
+const int32_t kMaxBlurRadius = 512;  // Keeps the box sums below 2^28
+const int64_t kMaxImageSamples = (int64_t(1)<<31)-1;  // See FitsWholeImage
+
+// Pixel of image_data_color_: R, G, B then an opaque X byte in memory order
+// on the little-endian targets of the practical, so two colors compare with
+// one integer compare and the buffer uploads as RGBA as it is.
+constexpr uint32_t PackColor(uint8_t r, uint8_t g, uint8_t b) {
+  return uint32_t(r)|(uint32_t(g)<<8)|(uint32_t(b)<<16)|0xFF000000u;
+}
+
+const uint32_t kColorBlack = PackColor(0, 0, 0);
+const uint32_t kColorRGBBits = 0x00FFFFFFu;  // 24-bit color of a pixel
+
+// Cached stage of ComputeSegmentation. It only reruns when the inputs it was
+// last computed from change, and every run bumps its version, which is itself
+// an input of the stages downstream.
+struct StageCache {
+  std::array<uint64_t, 8> inputs = {};
+  uint64_t version = 0;
+  bool valid = false;
+
+  bool Update(const std::array<uint64_t, 8>& current) {
+    if (valid && current == inputs) {
+      return false;
+    }
+    inputs = current;
+    valid = true;
+    ++version;
+    return true;
+  }
+};
+
+enum class FillMode {
+  kFloodFill,           // AddSeeds, FloodFill and ComputeHistogram
+  kConnectedComponents, // LabelCells and ColorizeLabels
+  kLabelPropagation,    // PropagateLabels and ColorizeLabels
+  kPyramid              // PyramidLabelCells and ColorizeLabels
+};
+
+// Gradient magnitude of ContourDetection, saturated to 255.
+enum class MagnitudeMode {
+  kL1,      // |Gx|+|Gy|
+  kL2,      // sqrt(Gx*Gx+Gy*Gy) from a reciprocal square root estimate
+  kSquared  // Exact sqrt(Gx*Gx+Gy*Gy); FusedEdgeMask compares the squares
+};
+
+// Horizontal run [x_begin, x_end] of row y, whose row y+dy still has to be
+// scanned.
+struct FillSpan {
+  int32_t x_begin;
+  int32_t x_end;
+  int32_t y;
+  int32_t dy;
+};
+
+// Statistics of the cells of labels_, as one array per field: entry c
+// describes the cell of label c+1. The bounding box is inclusive and the
+// mean color is the mean of the input pixels in 8-bit levels, gray repeated
+// for 1 channel.
+struct CellStats {
+  std::vector<uint32_t> area;
+  std::vector<int32_t> min_x;
+  std::vector<int32_t> min_y;
+  std::vector<int32_t> max_x;
+  std::vector<int32_t> max_y;
+  std::vector<float> centroid_x;
+  std::vector<float> centroid_y;
+  std::vector<float> mean_r;
+  std::vector<float> mean_g;
+  std::vector<float> mean_b;
+
+  void Resize(size_t count) {
+    area.resize(count);
+    min_x.resize(count);
+    min_y.resize(count);
+    max_x.resize(count);
+    max_y.resize(count);
+    centroid_x.resize(count);
+    centroid_y.resize(count);
+    mean_r.resize(count);
+    mean_g.resize(count);
+    mean_b.resize(count);
+  }
+
+  size_t size() const {
+    return area.size();
+  }
+};
+
+struct Content {
+  int32_t width = 1024;
+  int32_t height = 1024;
+  const uint8_t* image_pixels_ = nullptr;  // Input, image_channels_ per pixel
+  int32_t image_channels_ = 3;         // 3 for RGB, 1 for grayscale
+  PixelType image_pixel_type_ = PixelType::kU8;  // Samples of image_pixels_
+  std::vector<uint8_t> image_original_;// Decoded pixels behind image_pixels_
+  MappedImage mapped_image_;           // Mapped file behind image_pixels_
+  std::vector<uint32_t> image_data_color_;  // PackColor pixels
+  std::vector<uint8_t> image_data_grayscale_;  // Samples of image_pixel_type_
+  EdgeMask edge_mask_;
+  std::vector<std::pair<int32_t, int32_t>> seeds_;
+  int32_t cell_count_ = 0;
+  // Flood fill mode: pixels of image_data_color_ per R, G then B value.
+  std::array<uint32_t, 3*256> color_histogram_{};
+  CellStats cell_stats_;               // Labelled modes, compute_cell_stats_
+  int64_t pyramid_mismatches_ = -1;    // verify_pyramid_, -1 when unchecked
+
+  uint64_t image_version_ = 0;         // Bump when image_pixels_ changes
+  int32_t blur_radius_ = 1;
+  BorderPolicy border_policy_ = BorderPolicy::kClamp;  // Blur and Sobel
+  MagnitudeMode magnitude_mode_ = MagnitudeMode::kSquared;
+  uint8_t level_threshold_ = kLevelThreshold;
+  int32_t seed_count_ = 1024;
+  uint64_t rng_seed_ = 0;              // Seeds of AddSeeds and the palettes
+  SeedPlacement seed_placement_ = SeedPlacement::kUniform;
+  FillMode fill_mode_ = FillMode::kConnectedComponents;
+  int32_t thread_count_ = 0;           // 0 uses every hardware thread
+  bool report_stage_scaling_ = false;  // Viewer --report-scaling at startup
+  SimdLevel simd_level_ = DetectSimdLevel();
+  bool use_fused_pipeline_ = true;     // FusedEdgeMask instead of the 4 stages
+  bool compute_cell_stats_ = false;    // ComputeCellStats after the labels
+  int32_t pyramid_levels_ = 3;         // Blocks of 2^levels pixels, 1 to 6
+  bool verify_pyramid_ = false;        // Check the pyramid labels
+  std::vector<uint8_t> image_scratch_; // Swapped with image_data_grayscale_
+  std::vector<std::atomic<uint64_t>> color_bits_;  // Shared 24-bit color set
+  std::vector<uint32_t> color_words_;  // Used words of color_bits_
+  std::vector<uint32_t> labels_;       // Cell of each pixel, 0 on edges
+  EdgeMask coarse_mask_;               // Block level of PyramidLabelCells
+  std::vector<FillSpan> fill_spans_;   // Span stack reused by FloodFill
+  FrameArena frame_arena_;             // Scratch of the stages, see below
+  Profiler* profiler_ = nullptr;       // Times every stage when not null
+  ThreadPool thread_pool_;             // Defaults to every hardware thread
+
+  StageCache contour_stage_;           // Grayscale, blur and Sobel
+  StageCache level_stage_;             // edge_mask_
+  StageCache cells_stage_;             // Colors, cell_count_, cell_stats_
+};
+
+// The stages index the samples of a whole image with int32_t, so a decoded
+// or mapped image is limited to kMaxImageSamples samples. SegmentTiled has
+// no such limit, its strips staying below it.
+inline bool FitsWholeImage(int64_t width, int64_t height, int32_t channels) {
+  return width*height <= kMaxImageSamples/channels;
+}
+
+// Decodes an image file as RGB in the bytes of rgb, with samples of type:
+// 16-bit for 16-bit PNG and PNM files, float for Radiance HDR files and 8-bit
+// for anything else. Returns false when it cannot, or when the image does
+// not FitsWholeImage.
+bool DecodeImage(
+  const std::string& path, int32_t& width, int32_t& height,
+  std::vector<uint8_t>& rgb, PixelType& type);
+
+// Points image_pixels_ at an image file. 8-bit binary PPM and PGM files are
+// mapped and used in place, anything else is decoded with DecodeImage into
+// image_original_, keeping its bit depth. Returns false, leaving an empty
+// image, when the file cannot be read or the image does not FitsWholeImage.
+bool LoadImage(Content& content, const std::string& path);
+
+// Maps a headerless file of width*height pixels of `channels` (1 or 3)
+// bytes. Returns false, leaving an empty image, when the size of the file
+// does not match or the image does not FitsWholeImage.
+bool LoadRawImage(
+  Content& content, const std::string& path, int32_t width, int32_t height,
+  int32_t channels = 3);
+
+// Swaps rgb, RGB samples of type, with image_original_ and points
+// image_pixels_ at it, so rgb gets the previous image buffer back for reuse.
+void SetImage(
+  Content& content, int32_t width, int32_t height,
+  std::vector<uint8_t>& rgb, PixelType type = PixelType::kU8);
+
+// The stages draw their temporary buffers from frame_arena_, which
+// ComputeSegmentation resets at the start of every call. Code running the
+// stages on its own has to call frame_arena_.Reset() between frames.
+void GrayscaleConversion(Content& content);
+void BlurImage(Content& content);
+void ContourDetection(Content& content);
+void ApplyLevel(Content& content);
+void FusedEdgeMask(Content& content);
+void ClearImage(Content& content);
+void AddSeeds(Content& content);
+void FloodFill(Content& content);
+void ComputeHistogram(Content& content);
+void LabelCells(Content& content);
+void PropagateLabels(Content& content);
+void PyramidLabelCells(Content& content);
+void ColorizeLabels(Content& content);
+void ComputeCellStats(Content& content);
+
+// Building blocks of the labelling stages, also used by the tiled mode.
+// LabelMask labels the 4-connected non-edge regions of mask in raster order
+// of their first pixel and returns their number. UnionCells links the
+// larger root under the smaller one.
+uint32_t LabelMask(
+  const EdgeMask& mask, ThreadPool& thread_pool, FrameArena& arena,
+  uint32_t* labels);
+uint32_t FindRoot(uint32_t* parents, uint32_t i);
+void UnionCells(uint32_t* parents, uint32_t a, uint32_t b);
+// palette[0] is black, palette[1..cell_count] the colors of ColorizeLabels.
+void BuildPalette(uint64_t rng_seed, uint32_t cell_count, uint32_t* palette);
+
+// Runs the stages whose inputs changed since the last call and returns true
+// when image_data_color_ and cell_count_ were recomputed.
+bool ComputeSegmentation(Content& content);
+
+void InvalidateStages(Content& content);
+void ReportStageScaling(
+  Content& content, std::ostream& out, int32_t repetitions = 20);
+
+#endif  // PRACTICAL_MARKED_SEGMENTATION_H_
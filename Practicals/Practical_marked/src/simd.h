@@ -0,0 +1,86 @@
+#ifndef PRACTICAL_MARKED_SIMD_H_
+#define PRACTICAL_MARKED_SIMD_H_
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+// GCC and Clang only emit SSE4.1/AVX2 instructions in functions that opt in,
+// so the kernels can live next to the scalar code and be chosen at runtime.
+// MSVC allows intrinsics everywhere and needs no attribute.
+#if SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SIMD_TARGET_SSE41
+#define SIMD_TARGET_AVX2
+#endif
+
+enum class SimdLevel {
+  kScalar = 0,
+  kSSE41 = 1,
+  kAVX2 = 2
+};
+
+inline SimdLevel DetectSimdLevel() {
+#if SIMD_X86 && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  const int max_leaf = info[0];
+  __cpuid(info, 1);
+  const bool sse41 = (info[2]&(1<<19)) != 0;
+  const bool osxsave = (info[2]&(1<<27)) != 0;
+  const bool avx = (info[2]&(1<<28)) != 0;
+  bool avx2 = false;
+  if (max_leaf >= 7 && osxsave && avx) {
+    __cpuidex(info, 7, 0);
+    const bool ymm_enabled = (_xgetbv(0)&0x6) == 0x6;
+    avx2 = ymm_enabled && (info[1]&(1<<5)) != 0;
+  }
+  if (avx2) {
+    return SimdLevel::kAVX2;
+  }
+  if (sse41) {
+    return SimdLevel::kSSE41;
+  }
+#elif SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SimdLevel::kAVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return SimdLevel::kSSE41;
+  }
+#endif
+  return SimdLevel::kScalar;
+}
+
+inline const char* SimdLevelName(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::kAVX2: return "AVX2";
+    case SimdLevel::kSSE41: return "SSE4.1";
+    default: return "scalar";
+  }
+}
+
+inline int32_t PopCount(uint64_t bits) {
+#if defined(_MSC_VER) && defined(_M_X64)
+  return static_cast<int32_t>(__popcnt64(bits));
+#elif defined(_MSC_VER)
+  return static_cast<int32_t>(
+    __popcnt(static_cast<uint32_t>(bits))+
+    __popcnt(static_cast<uint32_t>(bits>>32)));
+#else
+  return __builtin_popcountll(bits);
+#endif
+}
+
+#endif  // PRACTICAL_MARKED_SIMD_H_
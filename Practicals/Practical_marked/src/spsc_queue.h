@@ -0,0 +1,123 @@
+#ifndef PRACTICAL_MARKED_SPSC_QUEUE_H_
+#define PRACTICAL_MARKED_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue between exactly one producer thread and one
+// consumer thread. Push blocks while the queue is full, which throttles a
+// producer running ahead of its consumer, and Pop blocks while it is empty.
+// A blocked thread sleeps on a condition variable rather than spinning, so a
+// stalled stage leaves its core to the others. The mutex is only taken by a
+// thread about to sleep and by the one waking it.
+template <typename T>
+class SpscQueue {
+ public:
+  // The capacity is rounded up to a power of two.
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    }
+    slots_.resize(size);
+    mask_ = size-1;
+  }
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  size_t capacity() const {
+    return mask_+1;
+  }
+
+  // Leaves value untouched and returns false when the queue is full.
+  bool TryPush(T& value) {
+    if (!Insert(value)) {
+      return false;
+    }
+    Wake(consumer_waiting_, not_empty_);
+    return true;
+  }
+
+  bool TryPop(T& value) {
+    if (!Remove(value)) {
+      return false;
+    }
+    Wake(producer_waiting_, not_full_);
+    return true;
+  }
+
+  void Push(T value) {
+    if (!Insert(value)) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      producer_waiting_.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      not_full_.wait(lock, [&]() { return Insert(value); });
+      producer_waiting_.store(false, std::memory_order_relaxed);
+    }
+    Wake(consumer_waiting_, not_empty_);
+  }
+
+  T Pop() {
+    T value;
+    if (!Remove(value)) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      consumer_waiting_.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      not_empty_.wait(lock, [&]() { return Remove(value); });
+      consumer_waiting_.store(false, std::memory_order_relaxed);
+    }
+    Wake(producer_waiting_, not_full_);
+    return value;
+  }
+
+ private:
+  bool Insert(T& value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail-head_.load(std::memory_order_acquire) > mask_) {
+      return false;
+    }
+    slots_[tail&mask_] = std::move(value);
+    tail_.store(tail+1, std::memory_order_release);
+    return true;
+  }
+
+  bool Remove(T& value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = std::move(slots_[head&mask_]);
+    head_.store(head+1, std::memory_order_release);
+    return true;
+  }
+
+  // The fences pair with the ones of Push and Pop: either the sleeper sees
+  // the new head_ or tail_ before it waits, or this sees its flag. Taking
+  // the mutex then makes sure the sleeper is waiting before it is notified.
+  void Wake(std::atomic<bool>& waiting, std::condition_variable& wake_up) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed)) {
+      { std::lock_guard<std::mutex> lock(mutex_); }
+      wake_up.notify_one();
+    }
+  }
+
+  std::vector<T> slots_;
+  size_t mask_ = 0;
+  // The producer only writes tail_ and the consumer only writes head_, so
+  // they live on separate cache lines.
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  std::atomic<bool> producer_waiting_{false};  // Asleep in Push
+  std::atomic<bool> consumer_waiting_{false};  // Asleep in Pop
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+};
+
+#endif  // PRACTICAL_MARKED_SPSC_QUEUE_H_
@@ -0,0 +1,144 @@
+#ifndef PRACTICAL_MARKED_STENCIL_H_
+#define PRACTICAL_MARKED_STENCIL_H_
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <utility>
+
+// How a stencil reads the pixels outside the image.
+enum class BorderPolicy {
+  kClamp,   // Repeats the closest pixel
+  kMirror,  // Reflects around the first and last pixels: 2 1 | 0 1 2
+  kZero     // Reads 0
+};
+
+// Border policies map a coordinate of [-inf, +inf) to [0, size), or to -1
+// where the pixel reads as 0.
+struct ClampBorder {
+  static int32_t Index(int32_t i, int32_t size) {
+    return std::min(std::max(i, 0), size-1);
+  }
+};
+
+struct MirrorBorder {
+  static int32_t Index(int32_t i, int32_t size) {
+    if (size == 1) {
+      return 0;
+    }
+    const int32_t period = 2*(size-1);
+    i %= period;
+    if (i < 0) {
+      i += period;
+    }
+    return i < size ? i : period-i;
+  }
+};
+
+struct ZeroBorder {
+  static int32_t Index(int32_t i, int32_t size) {
+    return i < 0 || i >= size ? -1 : i;
+  }
+};
+
+// Calls visit(ClampBorder()), visit(MirrorBorder()) or visit(ZeroBorder()),
+// turning the runtime policy into a type the stencils are instantiated on.
+template <typename Visitor>
+void WithBorder(BorderPolicy policy, const Visitor& visit) {
+  switch (policy) {
+    case BorderPolicy::kMirror: visit(MirrorBorder()); break;
+    case BorderPolicy::kZero: visit(ZeroBorder()); break;
+    default: visit(ClampBorder()); break;
+  }
+}
+
+// Square kernel of kSize*kSize integer coefficients in row order. Apply
+// expands to one multiply-add per nonzero coefficient, with the offsets as
+// constants, so nothing is left of the kernel at runtime.
+template <int32_t kSize, int32_t... kCoefficients>
+struct StencilKernel {
+  static_assert(kSize%2 == 1, "The kernel needs a center");
+  static_assert(
+    sizeof...(kCoefficients) == kSize*kSize, "One coefficient per tap");
+  static constexpr int32_t kRadius = kSize/2;
+
+  // Sum of the coefficients times tap(dx, dy), the input at offset (dx, dy),
+  // in the type of the taps. The terms are added in row order, so floating
+  // point sums are reproducible.
+  template <typename Tap>
+  static auto Apply(const Tap& tap) {
+    return ApplyTaps(tap, std::make_integer_sequence<int32_t, kSize*kSize>());
+  }
+
+ private:
+  static constexpr std::array<int32_t, kSize*kSize> kWeights = {
+    kCoefficients...};
+
+  template <typename Tap, int32_t... kIndex>
+  static auto ApplyTaps(
+      const Tap& tap, std::integer_sequence<int32_t, kIndex...>) {
+    using Sum = decltype(tap(0, 0));
+    return (Sum(0)+...+(kWeights[kIndex] == 0 ? Sum(0) :
+      kWeights[kIndex]*tap(kIndex%kSize-kRadius, kIndex/kSize-kRadius)));
+  }
+};
+
+// Row y of the image as seen through Border: a row of the image, or
+// zero_row for the rows reading as 0.
+template <typename Border, typename T>
+const T* BorderRow(
+    const T* image, int32_t width, int32_t height, int32_t y,
+    const T* zero_row) {
+  const int32_t index = Border::Index(y, height);
+  return index < 0 ? zero_row : image+index*width;
+}
+
+// Writes output[x] = op(tap) for the kRadius columns on each side of a row,
+// tap(dx, dy) reading rows[kRadius+dy] at x+dx resolved through Border. The
+// callers resolve the rows above and below the image the same way. The taps
+// are the input samples promoted to int32_t, or float.
+template <int32_t kRadius, typename Border, typename In, typename Out,
+          typename Op>
+void StencilBorderColumns(
+    const In* const* rows, int32_t width, Out* output, const Op& op) {
+  auto border_pixel = [&](int32_t x) {
+    output[x] = op([&](int32_t dx, int32_t dy) -> decltype(+In()) {
+      const int32_t index = Border::Index(x+dx, width);
+      return index < 0 ? 0 : rows[kRadius+dy][index];
+    });
+  };
+  const int32_t interior_begin = std::min(kRadius, width);
+  const int32_t interior_end = std::max(width-kRadius, interior_begin);
+  for (int32_t x=0; x<interior_begin; ++x) {
+    border_pixel(x);
+  }
+  for (int32_t x=interior_end; x<width; ++x) {
+    border_pixel(x);
+  }
+}
+
+// Writes output[x] = op(tap) for x in [begin, end), which must stay kRadius
+// columns away from the sides. The taps read the rows directly, in a loop
+// the compiler unrolls and vectorizes.
+template <int32_t kRadius, typename In, typename Out, typename Op>
+void StencilInterior(
+    const In* const* rows, int32_t begin, int32_t end, Out* output,
+    const Op& op) {
+  for (int32_t x=begin; x<end; ++x) {
+    output[x] = op([&](int32_t dx, int32_t dy) -> decltype(+In()) {
+      return rows[kRadius+dy][x+dx];
+    });
+  }
+}
+
+// Applies op to every pixel of a row: the interior columns without any
+// border check, and only the kRadius columns on each side through Border.
+template <int32_t kRadius, typename Border, typename In, typename Out,
+          typename Op>
+void StencilRow(
+    const In* const* rows, int32_t width, Out* output, const Op& op) {
+  StencilBorderColumns<kRadius, Border>(rows, width, output, op);
+  StencilInterior<kRadius>(rows, kRadius, width-kRadius, output, op);
+}
+
+#endif  // PRACTICAL_MARKED_STENCIL_H_
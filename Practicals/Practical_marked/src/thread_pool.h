@@ -0,0 +1,134 @@
+#ifndef PRACTICAL_MARKED_THREAD_POOL_H_
+#define PRACTICAL_MARKED_THREAD_POOL_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent workers splitting a range of rows into one contiguous band per
+// thread. The calling thread runs the first band itself, so a pool of one
+// thread executes everything inline without any synchronization.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int32_t thread_count = 0) {
+    Resize(thread_count);
+  }
+
+  ~ThreadPool() {
+    Stop();
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int32_t thread_count() const {
+    return static_cast<int32_t>(workers_.size())+1;
+  }
+
+  // 0 uses every hardware thread.
+  void Resize(int32_t thread_count) {
+    if (thread_count <= 0) {
+      thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (thread_count == this->thread_count()) {
+      return;
+    }
+    Stop();
+    stopping_ = false;
+    for (int32_t i=1; i<thread_count; ++i) {
+      workers_.emplace_back(
+        [this, i, seen = generation_]() { WorkerLoop(i, seen); });
+    }
+  }
+
+  // Splits [0, count) in thread_count() bands and blocks until every band is
+  // done, task(band, begin, end) processing the rows [begin, end) of band
+  // `band`. The split only depends on count and thread_count(). The task is
+  // called through a plain function pointer rather than a std::function, so
+  // dispatching a band never allocates.
+  template <typename Task>
+  void ParallelBands(int32_t count, const Task& task) {
+    const int32_t bands = thread_count();
+    if (count <= 0) {
+      return;
+    }
+    if (bands == 1 || count == 1) {
+      task(0, 0, count);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+      run_task_ = [](const void* task, int32_t band, int32_t begin,
+                     int32_t end) {
+        (*static_cast<const Task*>(task))(band, begin, end);
+      };
+      count_ = count;
+      pending_ = bands-1;
+      ++generation_;
+    }
+    wake_.notify_all();
+    RunBand(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return pending_ == 0; });
+    task_ = nullptr;
+  }
+
+ private:
+  void RunBand(int32_t band) {
+    const int64_t bands = thread_count();
+    const int32_t begin = static_cast<int32_t>(count_*band/bands);
+    const int32_t end = static_cast<int32_t>(count_*(band+1)/bands);
+    if (begin < end) {
+      run_task_(task_, band, begin, end);
+    }
+  }
+
+  void WorkerLoop(int32_t band, uint64_t seen) {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(
+          lock, [&]() { return stopping_ || generation_ != seen; });
+        if (stopping_) {
+          return;
+        }
+        seen = generation_;
+      }
+      RunBand(band);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --pending_;
+      }
+      done_.notify_one();
+    }
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+  }
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const void* task_ = nullptr;
+  void (*run_task_)(const void*, int32_t, int32_t, int32_t) = nullptr;
+  int64_t count_ = 0;
+  int32_t pending_ = 0;
+  uint64_t generation_ = 0;
+  bool stopping_ = false;
+};
+
+#endif  // PRACTICAL_MARKED_THREAD_POOL_H_
@@ -0,0 +1,135 @@
+#include "tiled.h"
+
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+// Labels rows [y, y+rows) of image into labels_ and returns their number of
+// cells. The stages see the strip and its halo as a whole image, so only the
+// halo rows next to a cut go through the border policy, and they are
+// dropped from the mask before labelling.
+uint32_t LabelStrip(
+    Content& content, const MappedImage& image, int32_t y, int32_t rows) {
+  ScopedTimer timer(content.profiler_, "LabelStrip");
+  const int32_t width = image.width();
+  const int32_t halo = content.blur_radius_+1;
+  const int32_t top = std::max(0, y-halo);
+  const int32_t bottom = std::min(image.height(), y+rows+halo);
+  content.width = width;
+  content.height = bottom-top;
+  content.image_channels_ = image.channels();
+  content.image_pixel_type_ = PixelType::kU8;
+  content.image_pixels_ = image.pixels()+size_t(top)*width*image.channels();
+  content.frame_arena_.Reset();
+  if (content.use_fused_pipeline_ && content.blur_radius_ == 1) {
+    FusedEdgeMask(content);
+  } else {
+    GrayscaleConversion(content);
+    BlurImage(content);
+    ContourDetection(content);
+    ApplyLevel(content);
+  }
+  EdgeMask& mask = content.edge_mask_;
+  std::copy(mask.Row(y-top), mask.Row(y-top+rows), mask.words.begin());
+  mask.Resize(width, rows);
+  content.labels_.resize(size_t(width)*rows);
+  return LabelMask(
+    mask, content.thread_pool_, content.frame_arena_, content.labels_.data());
+}
+
+int32_t TiledStripRows(
+    int32_t width, int32_t height, int32_t channels, int32_t blur_radius,
+    size_t memory_budget) {
+  // A strip with its halo is segmented as a whole image.
+  const int64_t budget_rows = std::min<int64_t>(
+    static_cast<int64_t>(memory_budget/(size_t(width)*kTiledBytesPerPixel)),
+    kMaxImageSamples/(int64_t(width)*channels));
+  if (budget_rows >= height) {
+    return height;
+  }
+  const int32_t halo = blur_radius+1;
+  return budget_rows < 1+2*halo ? 0 : static_cast<int32_t>(budget_rows-2*halo);
+}
+
+bool SegmentTiled(
+    Content& content, const MappedImage& image, size_t memory_budget,
+    const std::string& labels_path) {
+  const int32_t width = image.width();
+  const int32_t height = image.height();
+  const int32_t strip_rows = TiledStripRows(
+    width, height, image.channels(), content.blur_radius_, memory_budget);
+  if (strip_rows == 0) {
+    throw std::runtime_error("[ERROR] Memory budget below one strip");
+  }
+
+  // Every cell of every strip is a node, numbered strip after strip and in
+  // raster order inside a strip. The smallest node of a stitched cell is
+  // then the strip cell holding its first pixel, so the roots come in the
+  // raster order of the cells, as in LabelCells.
+  const uint32_t kNoNode = ~uint32_t(0);
+  std::vector<uint32_t> parents;
+  std::vector<uint32_t> seam(width, kNoNode);  // Last row above the seam
+  for (int32_t y=0; y<height; y+=strip_rows) {
+    const int32_t rows = std::min(strip_rows, height-y);
+    const uint32_t nodes = static_cast<uint32_t>(parents.size());
+    const uint32_t cells = LabelStrip(content, image, y, rows);
+    parents.resize(nodes+cells);
+    std::iota(parents.begin()+nodes, parents.end(), nodes);
+    const uint32_t* labels = content.labels_.data();
+    for (int32_t x=0; x<width; ++x) {
+      if (seam[x] != kNoNode && labels[x] != kEdgeLabel) {
+        UnionCells(parents.data(), seam[x], nodes+labels[x]-1);
+      }
+    }
+    const uint32_t* last_row = labels+size_t(rows-1)*width;
+    for (int32_t x=0; x<width; ++x) {
+      seam[x] = last_row[x] == kEdgeLabel ? kNoNode : nodes+last_row[x]-1;
+    }
+  }
+
+  // A root comes before the other nodes of its cell.
+  std::vector<uint32_t> node_labels(parents.size());
+  uint32_t cell_count = 0;
+  for (uint32_t node=0; node<parents.size(); ++node) {
+    const uint32_t root = FindRoot(parents.data(), node);
+    node_labels[node] = root == node ? ++cell_count : node_labels[root];
+  }
+
+  bool written = true;
+  if (!labels_path.empty()) {
+    std::vector<uint32_t> palette(size_t(cell_count)+1);
+    BuildPalette(content.rng_seed_, cell_count, palette.data());
+    std::ofstream file(labels_path, std::ios::binary);
+    file << "P6\n" << width << ' ' << height << "\n255\n";
+    std::vector<uint8_t> row_rgb(size_t(width)*3);
+    uint32_t nodes = 0;
+    for (int32_t y=0; y<height && file; y+=strip_rows) {
+      const int32_t rows = std::min(strip_rows, height-y);
+      const uint32_t cells = LabelStrip(content, image, y, rows);
+      for (int32_t row=0; row<rows; ++row) {
+        const uint32_t* labels = content.labels_.data()+size_t(row)*width;
+        for (int32_t x=0; x<width; ++x) {
+          const uint32_t color = labels[x] == kEdgeLabel ?
+            kColorBlack : palette[node_labels[nodes+labels[x]-1]];
+          row_rgb[x*3+0] = static_cast<uint8_t>(color);
+          row_rgb[x*3+1] = static_cast<uint8_t>(color>>8);
+          row_rgb[x*3+2] = static_cast<uint8_t>(color>>16);
+        }
+        file.write(
+          reinterpret_cast<const char*>(row_rgb.data()), row_rgb.size());
+      }
+      nodes += cells;
+    }
+    written = static_cast<bool>(file);
+  }
+
+  // The strips pointed into the mapping, which the caller owns.
+  content.image_pixels_ = nullptr;
+  content.width = width;
+  content.height = height;
+  content.cell_count_ = static_cast<int32_t>(cell_count);
+  InvalidateStages(content);
+  return written;
+}
@@ -0,0 +1,38 @@
+#ifndef PRACTICAL_MARKED_TILED_H_
+#define PRACTICAL_MARKED_TILED_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "mapped_image.h"
+#include "segmentation.h"
+
+// Scratch bytes per pixel of a strip: grayscale and blur buffers, edge mask,
+// labels and union-find parents.
+const size_t kTiledBytesPerPixel = 12;
+
+// Rows of the strips SegmentTiled cuts an image of width x height pixels of
+// `channels` samples into, without their halo. Returns 0 when memory_budget
+// does not fit a one-row strip with its halo, or when such a strip is too
+// large to be segmented as a whole image.
+int32_t TiledStripRows(
+  int32_t width, int32_t height, int32_t channels, int32_t blur_radius,
+  size_t memory_budget);
+
+// Segments an image that does not fit in memory, with the settings of
+// content, into the same cells as LabelCells on the whole image. The image,
+// with 8-bit samples, is cut in full-width strips sized to memory_budget and
+// read in place from the mapping, each strip with blur_radius_+1 rows of
+// halo so its edges match the whole-image ones. The strips are labelled one
+// by one and their cells stitched along the seams with a union-find, which
+// only grows with the number of cells. When labels_path is not empty, a
+// second pass writes the colored cells as a binary PPM, strip by strip. Sets
+// cell_count_, width and height to the ones of the whole image; the other
+// buffers of content only hold the last strip. Returns false when
+// labels_path cannot be written, and throws when TiledStripRows is 0.
+bool SegmentTiled(
+  Content& content, const MappedImage& image, size_t memory_budget,
+  const std::string& labels_path);
+
+#endif  // PRACTICAL_MARKED_TILED_H_